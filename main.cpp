@@ -1,8 +1,17 @@
 #include <algorithm>   // for std::max
 #include <vector>      // for std::vector used by power pillar wiring
-#include <GL/glut.h>
+#include <thread>      // frame capture writer
+#include <mutex>
+#include <condition_variable>
+#include <atomic>      // software renderer tile queue
+#include <chrono>      // headless frame timing
+#include <GL/freeglut.h>
+#include <GL/glext.h>
 #include <cmath>
+#include <cstdio>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 
 #ifndef M_PI
@@ -20,6 +29,22 @@ void drawThreeDDALamps();
 const float V_WIDTH = 800.0f;
 const float V_HEIGHT = 600.0f;
 
+// Current window size in pixels (updated by reshape)
+int gWindowW = (int)V_WIDTH;
+int gWindowH = (int)V_HEIGHT;
+
+// Largest 4:3 viewport that fits the window, centred (letterboxed)
+int gViewX = 0, gViewY = 0;
+int gViewW = (int)V_WIDTH;
+int gViewH = (int)V_HEIGHT;
+
+// Scene resolution = viewport * gRenderScale: above 1 supersamples
+// (offline renders), below 1 renders less and upscales (slow kiosks)
+float gRenderScale = 1.0f;
+int gRenderW = (int)V_WIDTH;
+int gRenderH = (int)V_HEIGHT;
+float gPixelScale = 1.0f;   // pixels per scene unit in the current target
+
 // Animation state variables
 float waterTime = 0.0f;
 float trainPos = -520.0f;
@@ -34,47 +59,2230 @@ float frandf() {
     return (float)rand() / (float)RAND_MAX;
 }
 
+// ==================== GL EXTENSIONS ====================
+
+// Entry points beyond OpenGL 1.1 (the Windows opengl32 baseline) are
+// fetched at runtime through freeglut so no extension library is needed.
+#define GL_EXT_FUNCS(X) \
+    X(PFNGLGENFRAMEBUFFERSPROC,        glGenFramebuffers) \
+    X(PFNGLDELETEFRAMEBUFFERSPROC,     glDeleteFramebuffers) \
+    X(PFNGLBINDFRAMEBUFFERPROC,        glBindFramebuffer) \
+    X(PFNGLFRAMEBUFFERTEXTURE2DPROC,   glFramebufferTexture2D) \
+    X(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus) \
+    X(PFNGLGENERATEMIPMAPPROC,         glGenerateMipmap) \
+    X(PFNGLBLENDFUNCSEPARATEPROC,      glBlendFuncSeparate) \
+    X(PFNGLCREATESHADERPROC,           glCreateShader) \
+    X(PFNGLSHADERSOURCEPROC,           glShaderSource) \
+    X(PFNGLCOMPILESHADERPROC,          glCompileShader) \
+    X(PFNGLGETSHADERIVPROC,            glGetShaderiv) \
+    X(PFNGLGETSHADERINFOLOGPROC,       glGetShaderInfoLog) \
+    X(PFNGLDELETESHADERPROC,           glDeleteShader) \
+    X(PFNGLCREATEPROGRAMPROC,          glCreateProgram) \
+    X(PFNGLATTACHSHADERPROC,           glAttachShader) \
+    X(PFNGLLINKPROGRAMPROC,            glLinkProgram) \
+    X(PFNGLGETPROGRAMIVPROC,           glGetProgramiv) \
+    X(PFNGLGETPROGRAMINFOLOGPROC,      glGetProgramInfoLog) \
+    X(PFNGLUSEPROGRAMPROC,             glUseProgram) \
+    X(PFNGLGETUNIFORMLOCATIONPROC,     glGetUniformLocation) \
+    X(PFNGLUNIFORM2FPROC,              glUniform2f) \
+    X(PFNGLUNIFORM4FPROC,              glUniform4f) \
+    X(PFNGLGENBUFFERSPROC,             glGenBuffers) \
+    X(PFNGLBINDBUFFERPROC,             glBindBuffer) \
+    X(PFNGLBUFFERDATAPROC,             glBufferData) \
+    X(PFNGLVERTEXATTRIBPOINTERPROC,    glVertexAttribPointer) \
+    X(PFNGLENABLEVERTEXATTRIBARRAYPROC,  glEnableVertexAttribArray) \
+    X(PFNGLDISABLEVERTEXATTRIBARRAYPROC, glDisableVertexAttribArray) \
+    X(PFNGLVERTEXATTRIBDIVISORPROC,    glVertexAttribDivisor) \
+    X(PFNGLDRAWARRAYSINSTANCEDPROC,    glDrawArraysInstanced) \
+    X(PFNGLDRAWELEMENTSINSTANCEDPROC,  glDrawElementsInstanced) \
+    X(PFNGLUNIFORM1IPROC,              glUniform1i) \
+    X(PFNGLGENVERTEXARRAYSPROC,        glGenVertexArrays) \
+    X(PFNGLBINDVERTEXARRAYPROC,        glBindVertexArray) \
+    X(PFNGLMAPBUFFERRANGEPROC,         glMapBufferRange) \
+    X(PFNGLUNMAPBUFFERPROC,            glUnmapBuffer) \
+    X(PFNGLFENCESYNCPROC,              glFenceSync) \
+    X(PFNGLCLIENTWAITSYNCPROC,         glClientWaitSync) \
+    X(PFNGLDELETESYNCPROC,             glDeleteSync) \
+    X(PFNGLBUFFERSTORAGEPROC,          glBufferStorage)
+
+#define GL_EXT_DECLARE(type, name) type p##name = NULL;
+GL_EXT_FUNCS(GL_EXT_DECLARE)
+
+#define glGenFramebuffers        pglGenFramebuffers
+#define glDeleteFramebuffers     pglDeleteFramebuffers
+#define glBindFramebuffer        pglBindFramebuffer
+#define glFramebufferTexture2D   pglFramebufferTexture2D
+#define glCheckFramebufferStatus pglCheckFramebufferStatus
+#define glGenerateMipmap         pglGenerateMipmap
+#define glBlendFuncSeparate      pglBlendFuncSeparate
+#define glCreateShader           pglCreateShader
+#define glShaderSource           pglShaderSource
+#define glCompileShader          pglCompileShader
+#define glGetShaderiv            pglGetShaderiv
+#define glGetShaderInfoLog       pglGetShaderInfoLog
+#define glDeleteShader           pglDeleteShader
+#define glCreateProgram          pglCreateProgram
+#define glAttachShader           pglAttachShader
+#define glLinkProgram            pglLinkProgram
+#define glGetProgramiv           pglGetProgramiv
+#define glGetProgramInfoLog      pglGetProgramInfoLog
+#define glUseProgram             pglUseProgram
+#define glGetUniformLocation     pglGetUniformLocation
+#define glUniform2f              pglUniform2f
+#define glUniform4f              pglUniform4f
+#define glGenBuffers             pglGenBuffers
+#define glBindBuffer             pglBindBuffer
+#define glBufferData             pglBufferData
+#define glVertexAttribPointer    pglVertexAttribPointer
+#define glEnableVertexAttribArray  pglEnableVertexAttribArray
+#define glDisableVertexAttribArray pglDisableVertexAttribArray
+#define glVertexAttribDivisor    pglVertexAttribDivisor
+#define glDrawArraysInstanced    pglDrawArraysInstanced
+#define glDrawElementsInstanced  pglDrawElementsInstanced
+#define glUniform1i              pglUniform1i
+#define glGenVertexArrays        pglGenVertexArrays
+#define glBindVertexArray        pglBindVertexArray
+#define glMapBufferRange         pglMapBufferRange
+#define glUnmapBuffer            pglUnmapBuffer
+#define glFenceSync              pglFenceSync
+#define glClientWaitSync         pglClientWaitSync
+#define glDeleteSync             pglDeleteSync
+#define glBufferStorage          pglBufferStorage
+
+bool gHasFramebuffers = false;
+bool gHasGL33 = false;     // GLSL 3.30 shaders + instanced arrays
+bool gCoreProfile = false; // running in a 3.3 core context (--core)
+bool gHeadless = false;    // software renderer, no GL context (--headless)
+bool gHasBufferStorage = false; // GL 4.4 / ARB_buffer_storage
+
+// Load all extension entry points; needs a current context
+void loadGLExtensions() {
+#define GL_EXT_LOAD(type, name) p##name = (type)glutGetProcAddress(#name);
+    GL_EXT_FUNCS(GL_EXT_LOAD)
+#undef GL_EXT_LOAD
+    gHasFramebuffers = pglGenFramebuffers && pglDeleteFramebuffers &&
+                       pglBindFramebuffer && pglFramebufferTexture2D &&
+                       pglCheckFramebufferStatus && pglGenerateMipmap &&
+                       pglBlendFuncSeparate;
+
+    int major = 0, minor = 0;
+    const char* version = (const char*)glGetString(GL_VERSION);
+    if (version) sscanf(version, "%d.%d", &major, &minor);
+    gHasGL33 = (major > 3 || (major == 3 && minor >= 3)) &&
+               pglCreateShader && pglShaderSource && pglCompileShader &&
+               pglGetShaderiv && pglGetShaderInfoLog && pglDeleteShader &&
+               pglCreateProgram && pglAttachShader &&
+               pglLinkProgram && pglGetProgramiv && pglGetProgramInfoLog &&
+               pglUseProgram && pglGetUniformLocation && pglUniform2f && pglUniform4f &&
+               pglGenBuffers && pglBindBuffer && pglBufferData &&
+               pglVertexAttribPointer && pglEnableVertexAttribArray &&
+               pglDisableVertexAttribArray && pglVertexAttribDivisor &&
+               pglDrawArraysInstanced && pglDrawElementsInstanced &&
+               pglUniform1i &&
+               pglGenVertexArrays && pglBindVertexArray &&
+               pglMapBufferRange && pglUnmapBuffer &&
+               pglFenceSync && pglClientWaitSync && pglDeleteSync;
+    gHasBufferStorage = gHasGL33 && pglBufferStorage &&
+                        (major > 4 || (major == 4 && minor >= 4) ||
+                         glutExtensionSupported("GL_ARB_buffer_storage"));
+}
+
+// Compile and link a shader program (attribute locations come from
+// layout qualifiers). Returns 0 (and prints the log) on failure.
+GLuint buildProgram(const char* vsSrc, const char* fsSrc) {
+    const char* srcs[2] = { vsSrc, fsSrc };
+    GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+    GLuint prog = glCreateProgram();
+    char log[1024];
+    for(int i = 0; i < 2; i++) {
+        GLuint sh = glCreateShader(types[i]);
+        glShaderSource(sh, 1, &srcs[i], NULL);
+        glCompileShader(sh);
+        GLint ok = 0;
+        glGetShaderiv(sh, GL_COMPILE_STATUS, &ok);
+        if (!ok) {
+            glGetShaderInfoLog(sh, sizeof(log), NULL, log);
+            fprintf(stderr, "shader compile failed:\n%s\n", log);
+            return 0;
+        }
+        glAttachShader(prog, sh);
+        glDeleteShader(sh);
+    }
+    glLinkProgram(prog);
+    GLint ok = 0;
+    glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        glGetProgramInfoLog(prog, sizeof(log), NULL, log);
+        fprintf(stderr, "shader link failed:\n%s\n", log);
+        return 0;
+    }
+    return prog;
+}
+
+// ==================== STREAMING RING BUFFER ====================
+
+// Per-frame vertex and instance data is written into one GPU buffer used
+// as a ring. The ring is split into segments; a fence is placed when the
+// writer leaves a segment and waited on before it comes back around, so
+// data the GPU has not consumed yet is never overwritten. With buffer
+// storage the ring stays mapped for the whole run, otherwise each
+// allocation maps its own unsynchronized range.
+const size_t RING_BYTES = 4u << 20;
+const int RING_SEGMENTS = 4;
+const size_t RING_SEGMENT_BYTES = RING_BYTES / RING_SEGMENTS;
+const size_t RING_ALIGN = 16;
+
+struct StreamRing {
+    GLuint vbo;
+    char* persistent;      // whole-ring mapping, NULL if mapped per allocation
+    size_t head;           // next free byte
+    int seg;               // segment being written
+    size_t reserved;       // size of the pending allocation
+    GLsync fences[RING_SEGMENTS];
+    int allocations;       // this frame
+    size_t bytes;          // bytes committed this frame
+    int stalls;            // allocations that had to wait for the GPU
+    int wraps;             // times the writer went back to the start
+};
+
+StreamRing gRing;
+
+// Create the ring; without sync objects / map range the callers keep
+// their glBufferData uploads
+void initStreamRing() {
+    memset(&gRing, 0, sizeof(gRing));
+    if (!gHasGL33) return;
+    glGenBuffers(1, &gRing.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, gRing.vbo);
+    if (gHasBufferStorage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                           GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, RING_BYTES, NULL, flags);
+        gRing.persistent = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0,
+                                                   RING_BYTES, flags);
+    }
+    if (!gRing.persistent)
+        glBufferData(GL_ARRAY_BUFFER, RING_BYTES, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Block until the GPU is done with a segment's previous contents
+void ringWaitSegment(int seg) {
+    GLsync fence = gRing.fences[seg];
+    if (!fence) return;
+    if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        gRing.stalls++;
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                1000000000u) == GL_TIMEOUT_EXPIRED) {}
+    }
+    glDeleteSync(fence);
+    gRing.fences[seg] = 0;
+}
+
+// Reserve up to `bytes` of space (at most one segment) and bind the ring
+// as GL_ARRAY_BUFFER. Returns where to write and stores the buffer
+// offset to draw from, or returns NULL if the ring can't take it.
+void* ringAllocate(size_t bytes, size_t* offset) {
+    if (!gRing.vbo || bytes == 0 || bytes > RING_SEGMENT_BYTES) return NULL;
+
+    // The segment is tracked rather than derived from the head, which
+    // sits exactly on the next boundary when the last commit filled it
+    size_t head = (gRing.head + RING_ALIGN - 1) & ~(RING_ALIGN - 1);
+    int seg = gRing.seg;
+    if (head + bytes > (size_t)(seg + 1) * RING_SEGMENT_BYTES) {
+        // Leave this segment: fence it and move on to the next one,
+        // wrapping to the start after the last
+        if (gRing.fences[seg]) glDeleteSync(gRing.fences[seg]);
+        gRing.fences[seg] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        seg = (seg + 1) % RING_SEGMENTS;
+        if (seg == 0) gRing.wraps++;
+        gRing.seg = seg;
+        head = seg * RING_SEGMENT_BYTES;
+        ringWaitSegment(seg);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, gRing.vbo);
+    void* ptr;
+    if (gRing.persistent) {
+        ptr = gRing.persistent + head;
+    } else {
+        ptr = glMapBufferRange(GL_ARRAY_BUFFER, head, bytes,
+                               GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT |
+                               GL_MAP_INVALIDATE_RANGE_BIT);
+        if (!ptr) return NULL;
+    }
+    gRing.head = head;
+    gRing.reserved = bytes;
+    gRing.allocations++;
+    *offset = head;
+    return ptr;
+}
+
+// Publish the first `used` bytes of the last allocation
+void ringCommit(size_t used) {
+    if (!gRing.persistent) glUnmapBuffer(GL_ARRAY_BUFFER);
+    if (used > gRing.reserved) used = gRing.reserved;
+    gRing.head += used;
+    gRing.bytes += used;
+    gRing.reserved = 0;
+}
+
+// Copy a block into the ring; returns its buffer offset, or (size_t)-1
+// when the caller has to upload it some other way
+size_t ringUpload(const void* data, size_t bytes) {
+    size_t offset;
+    void* ptr = ringAllocate(bytes, &offset);
+    if (!ptr) return (size_t)-1;
+    memcpy(ptr, data, bytes);
+    ringCommit(bytes);
+    return offset;
+}
+
+// ==================== GL STATE TRACKER ====================
+
+// Shadow copy of the GL state the renderer changes, starting from the
+// GL defaults. All changes go through the state* helpers, which drop
+// calls that would set a value GL already has.
+struct GLStateCache {
+    bool blend;
+    GLenum blendSrc, blendDst, blendSrcA, blendDstA;
+    float lineWidth, pointSize;
+    bool texture2D;        // fixed-function GL_TEXTURE_2D enable
+    GLuint texture;
+    GLuint program;
+    GLuint vao;
+    bool packedXf;         // fixed-function matrices unpack PackedVertex
+    float packedPos;       // position steps per unit they unpack
+    int issued;            // state calls sent to GL this frame
+    int elided;            // redundant calls dropped this frame
+};
+
+GLStateCache gState = {
+    false, GL_ONE, GL_ZERO, GL_ONE, GL_ZERO, 1.0f, 1.0f,
+    false, 0, 0, 0, false, 0.0f, 0, 0
+};
+
+// Count a state request; true if it changes something
+bool stateChanged(bool changed) {
+    if (changed) gState.issued++;
+    else gState.elided++;
+    return changed;
+}
+
+void stateBlend(bool on) {
+    if (!stateChanged(gState.blend != on)) return;
+    gState.blend = on;
+    if (on) glEnable(GL_BLEND);
+    else glDisable(GL_BLEND);
+}
+
+void stateBlendFunc(GLenum src, GLenum dst, GLenum srcA, GLenum dstA) {
+    if (!stateChanged(gState.blendSrc != src || gState.blendDst != dst ||
+                      gState.blendSrcA != srcA || gState.blendDstA != dstA))
+        return;
+    gState.blendSrc = src;
+    gState.blendDst = dst;
+    gState.blendSrcA = srcA;
+    gState.blendDstA = dstA;
+    if (src == srcA && dst == dstA) glBlendFunc(src, dst);
+    else glBlendFuncSeparate(src, dst, srcA, dstA);
+}
+
+void stateLineWidth(float width) {
+    if (!stateChanged(gState.lineWidth != width)) return;
+    gState.lineWidth = width;
+    glLineWidth(width);
+}
+
+void statePointSize(float size) {
+    if (!stateChanged(gState.pointSize != size)) return;
+    gState.pointSize = size;
+    glPointSize(size);
+}
+
+void stateTexture2D(bool on) {
+    if (!stateChanged(gState.texture2D != on)) return;
+    gState.texture2D = on;
+    if (on) glEnable(GL_TEXTURE_2D);
+    else glDisable(GL_TEXTURE_2D);
+}
+
+void stateBindTexture(GLuint tex) {
+    if (!stateChanged(gState.texture != tex)) return;
+    gState.texture = tex;
+    glBindTexture(GL_TEXTURE_2D, tex);
+}
+
+void stateUseProgram(GLuint prog) {
+    if (!stateChanged(gState.program != prog)) return;
+    gState.program = prog;
+    glUseProgram(prog);
+}
+
+void stateBindVertexArray(GLuint vao) {
+    if (!stateChanged(gState.vao != vao)) return;
+    gState.vao = vao;
+    glBindVertexArray(vao);
+}
+
+// Scale the fixed-function modelview and texture matrices so GL_SHORT
+// positions and texcoords come out in scene units (see PackedVertex)
+void statePackedTransform(bool on, float posScale, float uvScale) {
+    if (!stateChanged(gState.packedXf != on ||
+                      (on && gState.packedPos != posScale))) return;
+    gState.packedXf = on;
+    gState.packedPos = posScale;
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    if (on) glScalef(1.0f / uvScale, 1.0f / uvScale, 1.0f);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    if (on) glScalef(1.0f / posScale, 1.0f / posScale, 1.0f);
+}
+
+// ==================== TEXTURES ====================
+
+// RGBA8 textures with clamped edges. With a context they live in GL;
+// headless they are kept in memory for the software renderer and the
+// ids are indices into gSoftTextures, offset by one so 0 stays "none".
+struct SoftTexture {
+    int w, h;
+    bool linear;
+    std::vector<unsigned char> texels;   // rows bottom-up like GL
+};
+
+std::vector<SoftTexture> gSoftTextures;
+
+void softFlush();   // SOFTWARE RENDERER
+
+// Create a texture; texels may be NULL to leave it cleared
+GLuint createTexture(int w, int h, bool linear, const unsigned char* texels) {
+    if (gHeadless) {
+        SoftTexture t;
+        t.w = w;
+        t.h = h;
+        t.linear = linear;
+        t.texels.assign((size_t)w * h * 4, 0);
+        if (texels) memcpy(&t.texels[0], texels, t.texels.size());
+        gSoftTextures.push_back(t);
+        return (GLuint)gSoftTextures.size();
+    }
+    GLuint tex;
+    GLint filter = linear ? GL_LINEAR : GL_NEAREST;
+    glGenTextures(1, &tex);
+    stateBindTexture(tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, texels);
+    return tex;
+}
+
+// Replace a sub-rectangle of a texture
+void updateTexture(GLuint tex, int x, int y, int w, int h,
+                   const unsigned char* texels) {
+    if (gHeadless) {
+        softFlush();   // binned draws may still sample the old texels
+        SoftTexture& t = gSoftTextures[tex - 1];
+        for(int row = 0; row < h; row++)
+            memcpy(&t.texels[((size_t)(y + row) * t.w + x) * 4],
+                   texels + (size_t)row * w * 4, (size_t)w * 4);
+        return;
+    }
+    stateBindTexture(tex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h,
+                    GL_RGBA, GL_UNSIGNED_BYTE, texels);
+}
+
+// ==================== BATCHED RENDERER ====================
+
+// One vertex in the batch stream (position + texcoord + colour + shape)
+struct BatchVertex {
+    float x, y;
+    float u, v;
+    float r, g, b, a;
+    float shape;           // SHAPE_* below; u,v are then quad-local coords
+};
+
+// Per-vertex shape codes understood by the shader pipeline
+const float SHAPE_FLAT    = 0.0f;  // plain interpolated colour
+const float SHAPE_ELLIPSE = 1.0f;  // antialiased disc of radius 1 in u,v
+const float SHAPE_GLOW    = 2.0f;  // + rim/centre alpha ratio (0..1)
+const float SHAPE_SPRITE  = 3.0f;  // + GlowId, software renderer only
+
+// Largest glow ratio that stays below SHAPE_SPRITE, even after the 1/256
+// rounding of the packed stream; brighter rims are clamped to it
+const float SHAPE_GLOW_MAX_RATIO = 255.0f / 256.0f;
+
+// Primitive type of the vertices currently held by the batch
+enum BatchPrim {
+    BATCH_TRIANGLES,
+    BATCH_LINES,
+    BATCH_POINTS
+};
+
+// How queued vertices are blended into the target
+enum BlendMode {
+    BLEND_OFF,
+    BLEND_ALPHA,          // straight alpha (the scene's usual mode)
+    BLEND_PREMULTIPLIED   // premultiplied colour, used to composite layers
+};
+
+// Raster state shared by every vertex of one draw call
+struct BatchState {
+    BatchPrim prim;
+    BlendMode blend;
+    float size;            // point size / line width
+    GLuint texture;        // 0 = untextured
+};
+
+// True if two states can share one draw call
+bool sameBatchState(const BatchState& a, const BatchState& b) {
+    return a.prim == b.prim && a.blend == b.blend &&
+           a.size == b.size && a.texture == b.texture;
+}
+
+// 2D transform (scale then translate) applied to every batched vertex
+struct BatchTransform {
+    float tx, ty;
+    float sx, sy;
+};
+
+// Accumulates every primitive of a frame into one vertex array and only
+// hands it to GL when the primitive type or raster state has to change.
+struct Batch {
+    std::vector<BatchVertex> verts;
+    BatchState stream;     // state of the vertices already queued
+    bool blend;            // blending requested by the scene code
+    float pointSize;
+    float lineWidth;
+    float cr, cg, cb, ca;  // current colour for lines and points
+    BatchTransform xf;
+    std::vector<BatchTransform> xfStack;
+    int drawCalls;         // glDrawArrays calls issued this frame
+    int lastDrawCalls;     // ... and in the previous frame
+};
+
+Batch gBatch = {
+    std::vector<BatchVertex>(), { BATCH_TRIANGLES, BLEND_ALPHA, 1.0f, 0 },
+    true, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f,
+    { 0.0f, 0.0f, 1.0f, 1.0f }, std::vector<BatchTransform>(), 0, 0
+};
+
+// Set blending and point size / line width for a batch state;
+// returns the GL primitive to draw with
+GLenum applyBatchState(const BatchState& st) {
+    if (st.blend == BLEND_OFF) {
+        stateBlend(false);
+    } else {
+        stateBlend(true);
+        if (st.blend == BLEND_PREMULTIPLIED)
+            stateBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA,
+                           GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        else if (gHasFramebuffers)
+            // Keep destination alpha as coverage so offscreen layers
+            // can be composited later with premultiplied blending
+            stateBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+                           GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        else
+            stateBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+                           GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+
+    // Widths are in scene units at 800x600; keep them proportional
+    GLenum mode = GL_TRIANGLES;
+    if (st.prim == BATCH_LINES) {
+        stateLineWidth(st.size * gPixelScale);
+        mode = GL_LINES;
+    } else if (st.prim == BATCH_POINTS) {
+        statePointSize(st.size * gPixelScale);
+        mode = GL_POINTS;
+    }
+    return mode;
+}
+
+// A static mesh recorded from batch output: vertices plus one range per
+// raster state, in submission order
+struct MeshRange {
+    BatchState state;
+    int first, count;
+};
+
+struct RecordedMesh {
+    std::vector<BatchVertex> verts;
+    std::vector<MeshRange> ranges;
+};
+
+// While non-NULL, batchFlush appends to this mesh instead of drawing
+RecordedMesh* gBatchRecord = NULL;
+
+// Move the queued vertices into the mesh being recorded
+void batchRecord(RecordedMesh& rec) {
+    const BatchState& st = gBatch.stream;
+    if (rec.ranges.empty() || !sameBatchState(rec.ranges.back().state, st)) {
+        MeshRange r = { st, (int)rec.verts.size(), 0 };
+        rec.ranges.push_back(r);
+    }
+    rec.ranges.back().count += (int)gBatch.verts.size();
+    rec.verts.insert(rec.verts.end(), gBatch.verts.begin(), gBatch.verts.end());
+    gBatch.verts.clear();
+}
+
+// ==================== SHADER PIPELINE ====================
+
+// Vertex attribute locations shared by every program
+//   0 aPos, 1 aColor, 2 aXform (instanced), 3 aTint (instanced), 4 aUV, 5 aShape
+const char* BATCH_VS =
+    "#version 330\n"
+    "layout(location = 0) in vec2 aPos;\n"
+    "layout(location = 1) in vec4 aColor;\n"
+    "layout(location = 4) in vec2 aUV;\n"
+    "layout(location = 5) in float aShape;\n"
+    "uniform vec2 uView;\n"   // 2 / view size (and position scale)
+    "uniform vec2 uUnpack;\n" // UV and shape scale
+    "out vec4 vColor;\n"
+    "out vec2 vUV;\n"
+    "out float vShape;\n"
+    "void main() {\n"
+    "    gl_Position = vec4(aPos * uView - 1.0, 0.0, 1.0);\n"
+    "    vColor = aColor;\n"
+    "    vUV = aUV * uUnpack.x;\n"
+    "    vShape = aShape * uUnpack.y;\n"
+    "}\n";
+
+// Flat, textured and signed-distance shapes. Ellipses get one pixel of
+// analytic antialiasing; glows fade linearly from the centre alpha to
+// ratio * centre alpha at the rim, like the old Gouraud-shaded fans.
+const char* SHAPE_FS =
+    "#version 330\n"
+    "in vec4 vColor;\n"
+    "in vec2 vUV;\n"
+    "in float vShape;\n"
+    "uniform sampler2D uTex;\n"
+    "uniform int uTextured;\n"
+    "out vec4 fragColor;\n"
+    "void main() {\n"
+    "    vec4 c = vColor;\n"
+    "    if (uTextured != 0) {\n"
+    "        c *= texture(uTex, vUV);\n"
+    "    } else if (vShape >= 0.5) {\n"
+    "        float r = length(vUV);\n"
+    "        float aa = max(fwidth(r), 1e-4);\n"
+    "        float cover = clamp((1.0 - r) / aa + 0.5, 0.0, 1.0);\n"
+    "        if (vShape >= 1.5)\n"
+    "            c.a *= mix(1.0, vShape - 2.0, min(r, 1.0));\n"
+    "        c.a *= cover;\n"
+    "        if (c.a <= 0.0) discard;\n"
+    "    }\n"
+    "    fragColor = c;\n"
+    "}\n";
+
+GLuint gBatchProgram = 0;
+GLint gBatchViewLoc = -1;
+GLint gBatchTexturedLoc = -1;
+GLint gBatchUnpackLoc = -1;
+GLuint gBatchVbo = 0;
+GLuint gVao = 0;
+
+// Core-profile path: build the batch program and its buffers
+bool initShaderPipeline() {
+    gBatchProgram = buildProgram(BATCH_VS, SHAPE_FS);
+    if (!gBatchProgram) return false;
+    gBatchViewLoc = glGetUniformLocation(gBatchProgram, "uView");
+    gBatchTexturedLoc = glGetUniformLocation(gBatchProgram, "uTextured");
+    gBatchUnpackLoc = glGetUniformLocation(gBatchProgram, "uUnpack");
+    glGenBuffers(1, &gBatchVbo);
+    glGenVertexArrays(1, &gVao);
+    return true;
+}
+
+// Point the shape attributes (aPos, aColor, aUV, aShape) at a buffer
+// of BatchVertex (or structs starting with one), from a byte offset
+void bindShapeAttribs(size_t base, GLsizei stride = sizeof(BatchVertex)) {
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(4);
+    glEnableVertexAttribArray(5);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride,
+                          (const void*)(base + offsetof(BatchVertex, x)));
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, stride,
+                          (const void*)(base + offsetof(BatchVertex, r)));
+    glVertexAttribPointer(4, 2, GL_FLOAT, GL_FALSE, stride,
+                          (const void*)(base + offsetof(BatchVertex, u)));
+    glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, stride,
+                          (const void*)(base + offsetof(BatchVertex, shape)));
+}
+
+// Disable every attribute array bindShapeAttribs / the props enabled
+void unbindShapeAttribs() {
+    for(int i = 0; i < 6; i++) glDisableVertexAttribArray(i);
+}
+
+// ---- Packed vertex stream ----
+// Streamed vertices go to the GPU in 16 bytes instead of 36: positions
+// in fixed point with at least 8 steps per target pixel (see
+// packPosScale), UVs in 1/4096 (+-8), RGBA8 colour and the shape code in
+// 1/256. Batches reaching outside the fixed-point range keep the float
+// arrays. Triangle lists are rewritten as quads: two triangles
+// a,b,c + a,c,d (every rect, quad and pair of fan slices) become one
+// quad a,b,c,d, and a lone triangle becomes a,b,c,c. All quads share
+// one static index buffer (0,1,2, 0,2,3, 4,5,6, ...).
+struct PackedVertex {
+    GLshort x, y;
+    GLshort u, v;
+    GLubyte r, g, b, a;
+    GLushort shape;
+    GLushort pad;
+};
+
+const float PACK_POS_SCALE = 8.0f;       // steps per target pixel
+const float PACK_POS_MAX_SCALE = 32.0f;  // +-1024 units, past the 800x600 scene
+const float PACK_UV_SCALE = 4096.0f;
+const float PACK_SHAPE_SCALE = 256.0f;
+const int MAX_PACKED_QUADS = 16384;    // keeps indices below 65536
+
+GLuint gQuadIbo = 0;
+
+// Build the shared quad index buffer
+void initQuadIndices() {
+    std::vector<GLushort> idx(MAX_PACKED_QUADS * 6);
+    for(int q = 0; q < MAX_PACKED_QUADS; q++) {
+        GLushort v = (GLushort)(q * 4);
+        GLushort* i = &idx[q * 6];
+        i[0] = v; i[1] = v + 1; i[2] = v + 2;
+        i[3] = v; i[4] = v + 2; i[5] = v + 3;
+    }
+    glGenBuffers(1, &gQuadIbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gQuadIbo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, idx.size() * sizeof(GLushort),
+                 &idx[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+GLshort packFixed(float v, float scale) {
+    float f = floorf(v * scale + 0.5f);
+    return (GLshort)std::max(-32768.0f, std::min(f, 32767.0f));
+}
+
+inline GLubyte packUnorm(float v) {
+    return (GLubyte)(std::max(0.0f, std::min(v, 1.0f)) * 255.0f + 0.5f);
+}
+
+// Position steps per scene unit on the current target: 1/8 px while a
+// unit is at most a pixel, finer on larger windows and supersampled
+// targets so edges keep their subpixel placement
+float packPosScale() {
+    float steps = PACK_POS_SCALE * ceilf(std::max(1.0f, gPixelScale));
+    return std::min(steps, PACK_POS_MAX_SCALE);
+}
+
+void packVertex(const BatchVertex& in, PackedVertex& out, float posScale) {
+    out.x = packFixed(in.x, posScale);
+    out.y = packFixed(in.y, posScale);
+    out.u = packFixed(in.u, PACK_UV_SCALE);
+    out.v = packFixed(in.v, PACK_UV_SCALE);
+    out.r = packUnorm(in.r);
+    out.g = packUnorm(in.g);
+    out.b = packUnorm(in.b);
+    out.a = packUnorm(in.a);
+    out.shape = (GLushort)(in.shape * PACK_SHAPE_SCALE + 0.5f);
+    out.pad = 0;
+}
+
+bool sameVertex(const BatchVertex& a, const BatchVertex& b) {
+    return memcmp(&a, &b, sizeof(BatchVertex)) == 0;
+}
+
+// Pack a triangle list as quads; returns the number of packed vertices
+size_t packTriangles(const BatchVertex* v, size_t count, PackedVertex* out,
+                     float posScale) {
+    size_t n = 0;
+    for(size_t i = 0; i + 2 < count; n += 4) {
+        packVertex(v[i], out[n], posScale);
+        packVertex(v[i + 1], out[n + 1], posScale);
+        packVertex(v[i + 2], out[n + 2], posScale);
+        if (i + 5 < count && sameVertex(v[i + 3], v[i]) &&
+            sameVertex(v[i + 4], v[i + 2])) {
+            packVertex(v[i + 5], out[n + 3], posScale);
+            i += 6;
+        } else {
+            out[n + 3] = out[n + 2];
+            i += 3;
+        }
+    }
+    return n;
+}
+
+// Pack vertices into the ring (quads for triangles, as-is for lines and
+// points) with posScale steps per unit. Returns the packed vertex count,
+// or 0 if the ring can't take it or a position is out of range.
+size_t ringUploadPacked(GLenum mode, const BatchVertex* verts, size_t count,
+                        float posScale, size_t* offset) {
+    if (!gQuadIbo) return 0;
+    size_t most = mode == GL_TRIANGLES ? count / 3 * 4 : count;
+    if (most > (size_t)MAX_PACKED_QUADS * 4) return 0;
+    float limit = 32767.0f / posScale;
+    for(size_t i = 0; i < count; i++)
+        if (fabsf(verts[i].x) > limit || fabsf(verts[i].y) > limit) return 0;
+    PackedVertex* out = (PackedVertex*)ringAllocate(most * sizeof(PackedVertex),
+                                                    offset);
+    if (!out) return 0;
+    size_t n = most;
+    if (mode == GL_TRIANGLES) n = packTriangles(verts, count, out, posScale);
+    else for(size_t i = 0; i < count; i++)
+        packVertex(verts[i], out[i], posScale);
+    ringCommit(n * sizeof(PackedVertex));
+    return n;
+}
+
+// Draw packed vertices from the bound arrays
+void drawPacked(GLenum mode, size_t n) {
+    if (mode != GL_TRIANGLES) {
+        glDrawArrays(mode, 0, (GLsizei)n);
+        return;
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gQuadIbo);
+    glDrawElements(GL_TRIANGLES, (GLsizei)(n / 4 * 6), GL_UNSIGNED_SHORT, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// Point the shape attributes at PackedVertex data from a byte offset
+void bindPackedAttribs(size_t base) {
+    GLsizei stride = sizeof(PackedVertex);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(4);
+    glEnableVertexAttribArray(5);
+    glVertexAttribPointer(0, 2, GL_SHORT, GL_FALSE, stride,
+                          (const void*)(base + offsetof(PackedVertex, x)));
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                          (const void*)(base + offsetof(PackedVertex, r)));
+    glVertexAttribPointer(4, 2, GL_SHORT, GL_FALSE, stride,
+                          (const void*)(base + offsetof(PackedVertex, u)));
+    glVertexAttribPointer(5, 1, GL_UNSIGNED_SHORT, GL_FALSE, stride,
+                          (const void*)(base + offsetof(PackedVertex, shape)));
+}
+
+// Draw vertices through the batch program
+void batchDrawShader(GLenum mode, const BatchState& st,
+                     const BatchVertex* verts, size_t count) {
+    stateBindVertexArray(gVao);
+    stateUseProgram(gBatchProgram);
+    glUniform1i(gBatchTexturedLoc, st.texture ? 1 : 0);
+    if (st.texture) stateBindTexture(st.texture);
+
+    size_t offset;
+    float posScale = packPosScale();
+    size_t packed = ringUploadPacked(mode, verts, count, posScale, &offset);
+    if (packed) {
+        glUniform2f(gBatchViewLoc, 2.0f / (V_WIDTH * posScale),
+                    2.0f / (V_HEIGHT * posScale));
+        glUniform2f(gBatchUnpackLoc, 1.0f / PACK_UV_SCALE, 1.0f / PACK_SHAPE_SCALE);
+        bindPackedAttribs(offset);
+        drawPacked(mode, packed);
+    } else {
+        glUniform2f(gBatchViewLoc, 2.0f / V_WIDTH, 2.0f / V_HEIGHT);
+        glUniform2f(gBatchUnpackLoc, 1.0f, 1.0f);
+        size_t bytes = count * sizeof(BatchVertex);
+        glBindBuffer(GL_ARRAY_BUFFER, gBatchVbo);
+        glBufferData(GL_ARRAY_BUFFER, bytes, verts, GL_STREAM_DRAW);
+        bindShapeAttribs(0);
+        glDrawArrays(mode, 0, (GLsizei)count);
+    }
+    unbindShapeAttribs();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void softDraw(const BatchState& st, const BatchVertex* verts, size_t count);
+
+// Draw vertices with one raster state and one draw call
+void batchDraw(const BatchState& st, const BatchVertex* verts, size_t count) {
+    gBatch.drawCalls++;
+    if (gHeadless) {
+        softDraw(st, verts, count);
+        return;
+    }
+    GLenum mode = applyBatchState(st);
+
+    if (gCoreProfile) {
+        batchDrawShader(mode, st, verts, count);
+        return;
+    }
+
+    stateUseProgram(0);
+    stateBindVertexArray(0);
+    stateTexture2D(st.texture != 0);
+    if (st.texture) stateBindTexture(st.texture);
+
+    // Packed arrays from the ring when there is one
+    size_t offset;
+    float posScale = packPosScale();
+    size_t packed = ringUploadPacked(mode, verts, count, posScale, &offset);
+    if (packed) {
+        const char* base = (const char*)0 + offset;
+        GLsizei stride = sizeof(PackedVertex);
+        statePackedTransform(true, posScale, PACK_UV_SCALE);
+        if (st.texture) {
+            glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+            glTexCoordPointer(2, GL_SHORT, stride, base + offsetof(PackedVertex, u));
+        }
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(2, GL_SHORT, stride, base + offsetof(PackedVertex, x));
+        glColorPointer(4, GL_UNSIGNED_BYTE, stride, base + offsetof(PackedVertex, r));
+        drawPacked(mode, packed);
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        if (st.texture) glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        return;
+    }
+
+    // Otherwise float arrays from client memory
+    const char* base = (const char*)verts;
+    statePackedTransform(false, PACK_POS_SCALE, PACK_UV_SCALE);
+    if (st.texture) {
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexCoordPointer(2, GL_FLOAT, sizeof(BatchVertex),
+                          base + offsetof(BatchVertex, u));
+    }
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(BatchVertex),
+                    base + offsetof(BatchVertex, x));
+    glColorPointer(4, GL_FLOAT, sizeof(BatchVertex),
+                   base + offsetof(BatchVertex, r));
+    glDrawArrays(mode, 0, (GLsizei)count);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (st.texture) glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+}
+
+// ---- Sort-key submission ----
+// With sorted submission on, flushes are queued under a 32-bit key
+// (8-bit layer | 8-bit state | 16-bit depth) and drawn, ordered by key,
+// at the next barrier. Layers keep the painter's order between them.
+// Inside a layer opened with byState the draws are grouped by raster
+// state and adjacent groups merged, so only content whose draw order
+// does not matter belongs there; other layers keep submission order.
+struct SortedDraw {
+    unsigned key;
+    BatchState state;
+    size_t first, count;
+};
+
+struct SortQueue {
+    bool enabled;
+    int layer;
+    bool byState;
+    int depth;
+    std::vector<BatchState> states;   // state ids, in order of first use
+    std::vector<SortedDraw> draws;
+    std::vector<BatchVertex> verts;
+    std::vector<BatchVertex> sorted;
+    int merged;                       // draws saved by merging this frame
+};
+
+SortQueue gSort = {
+    true, 0, false, 0, std::vector<BatchState>(), std::vector<SortedDraw>(),
+    std::vector<BatchVertex>(), std::vector<BatchVertex>(), 0
+};
+
+bool sortedDrawLess(const SortedDraw& a, const SortedDraw& b) {
+    return a.key < b.key;
+}
+
+// Small id for a raster state (by first use this frame)
+unsigned sortStateId(const BatchState& st) {
+    for(size_t i = 0; i < gSort.states.size(); i++)
+        if (sameBatchState(gSort.states[i], st)) return (unsigned)i;
+    gSort.states.push_back(st);
+    return (unsigned)std::min<size_t>(gSort.states.size() - 1, 255);
+}
+
+// Queue vertices under the current layer
+void sortQueueDraw(const BatchState& st, const BatchVertex* verts, size_t count) {
+    SortedDraw d;
+    d.key = ((unsigned)gSort.layer << 24) |
+            ((gSort.byState ? sortStateId(st) : 0u) << 16) |
+            (unsigned)std::min(gSort.depth++, 0xffff);
+    d.state = st;
+    d.first = gSort.verts.size();
+    d.count = count;
+    gSort.verts.insert(gSort.verts.end(), verts, verts + count);
+    gSort.draws.push_back(d);
+}
+
+// Draw everything queued, in key order, merging neighbours that share
+// a raster state
+void sortQueueSubmit() {
+    if (gSort.draws.empty()) return;
+    std::stable_sort(gSort.draws.begin(), gSort.draws.end(), sortedDrawLess);
+    gSort.sorted.clear();
+    size_t i = 0;
+    while (i < gSort.draws.size()) {
+        const BatchState& st = gSort.draws[i].state;
+        gSort.sorted.clear();
+        size_t j = i;
+        for(; j < gSort.draws.size() &&
+              sameBatchState(gSort.draws[j].state, st); j++) {
+            const SortedDraw& d = gSort.draws[j];
+            gSort.sorted.insert(gSort.sorted.end(),
+                                gSort.verts.begin() + d.first,
+                                gSort.verts.begin() + d.first + d.count);
+        }
+        gSort.merged += (int)(j - i - 1);
+        batchDraw(st, &gSort.sorted[0], gSort.sorted.size());
+        i = j;
+    }
+    gSort.draws.clear();
+    gSort.verts.clear();
+}
+
+// Submit everything queued so far with one draw call
+void batchFlush() {
+    if (gBatch.verts.empty()) return;
+    if (gBatchRecord) {
+        batchRecord(*gBatchRecord);
+        return;
+    }
+    if (gSort.enabled)
+        sortQueueDraw(gBatch.stream, &gBatch.verts[0], gBatch.verts.size());
+    else
+        batchDraw(gBatch.stream, &gBatch.verts[0], gBatch.verts.size());
+    gBatch.verts.clear();
+}
+
+// Flush and draw the sort queue; needed before any GL work that does
+// not go through the batch (instancing, static meshes, target switches)
+void batchBarrier() {
+    batchFlush();
+    sortQueueSubmit();
+}
+
+// Start a sort layer: later flushes are drawn after everything queued
+// in lower layers. byState allows reordering inside the layer.
+void setSortLayer(int layer, bool byState = false) {
+    batchFlush();
+    gSort.layer = std::min(layer, 255);
+    gSort.byState = byState;
+}
+
+// Make the stream accept vertices with exactly this raster state
+void batchBeginState(const BatchState& st) {
+    if (!sameBatchState(st, gBatch.stream)) {
+        batchFlush();
+        gBatch.stream = st;
+    }
+}
+
+// Make the stream accept vertices of the given primitive type.
+// Triangles are always streamed with blending on: a vertex drawn while the
+// scene has blending off gets alpha forced to 1, which blends to the exact
+// same pixel, so blend toggles in the scene code never split the stream.
+void batchBegin(BatchPrim prim, GLuint texture = 0,
+                BlendMode blend = BLEND_ALPHA) {
+    BatchState st;
+    st.prim = prim;
+    st.blend = blend;
+    if (prim != BATCH_TRIANGLES && !gBatch.blend) st.blend = BLEND_OFF;
+    st.size = 1.0f;
+    if (prim == BATCH_LINES) st.size = gBatch.lineWidth;
+    if (prim == BATCH_POINTS) st.size = gBatch.pointSize;
+    st.texture = texture;
+    batchBeginState(st);
+}
+
+// Append one vertex through the current transform
+void batchVertex(float x, float y, float r, float g, float b, float a) {
+    BatchVertex v;
+    v.x = x * gBatch.xf.sx + gBatch.xf.tx;
+    v.y = y * gBatch.xf.sy + gBatch.xf.ty;
+    v.u = 0.0f; v.v = 0.0f;
+    v.r = r; v.g = g; v.b = b;
+    v.a = gBatch.blend ? a : 1.0f;
+    v.shape = SHAPE_FLAT;
+    gBatch.verts.push_back(v);
+}
+
+// Append one textured vertex through the current transform
+void batchVertexUV(float x, float y, float u, float v,
+                   float r, float g, float b, float a) {
+    batchVertex(x, y, r, g, b, a);
+    gBatch.verts.back().u = u;
+    gBatch.verts.back().v = v;
+    gBatch.verts.back().a = a;
+}
+
+// Called at the start of display(): reset per-frame counters
+void batchBeginFrame() {
+    gBatch.lastDrawCalls = gBatch.drawCalls;
+    gBatch.drawCalls = 0;
+    gState.issued = 0;
+    gState.elided = 0;
+    gSort.layer = 0;
+    gSort.byState = false;
+    gSort.depth = 0;
+    gSort.states.clear();
+    gSort.merged = 0;
+    gRing.allocations = 0;
+    gRing.bytes = 0;
+}
+
+// Called at the end of display(): submit whatever is still queued
+void batchEndFrame() {
+    batchBarrier();
+}
+
+// Replacements for the fixed-function state calls used by the scene code
+void setBlend(bool on)          { gBatch.blend = on; }
+void setPointSize(float size)   { gBatch.pointSize = size; }
+void setLineWidth(float width)  { gBatch.lineWidth = width; }
+void setColor(float r, float g, float b, float a = 1.0f) {
+    gBatch.cr = r; gBatch.cg = g; gBatch.cb = b; gBatch.ca = a;
+}
+
+// Replacements for glPushMatrix/glTranslatef/glScalef/glPopMatrix
+void pushTransform() { gBatch.xfStack.push_back(gBatch.xf); }
+void popTransform() {
+    gBatch.xf = gBatch.xfStack.back();
+    gBatch.xfStack.pop_back();
+}
+void translate2D(float x, float y) {
+    gBatch.xf.tx += x * gBatch.xf.sx;
+    gBatch.xf.ty += y * gBatch.xf.sy;
+}
+void scale2D(float sx, float sy) {
+    gBatch.xf.sx *= sx;
+    gBatch.xf.sy *= sy;
+}
+
+// ==================== UNIT CIRCLE TABLES ====================
+
+// cos/sin of the segs+1 rim angles of a unit circle. Kept as two plain
+// arrays so the scale-and-offset loop below compiles to SIMD code.
+struct UnitCircle {
+    std::vector<float> cs;
+    std::vector<float> sn;
+};
+
+// Tables built so far, indexed by segment count
+std::vector<UnitCircle*> gUnitCircles;
+
+// Largest ring the scratch buffers below can hold
+const int MAX_CIRCLE_SEGS = 256;
+
+// Get (building on first use) the table for a segment count
+const UnitCircle& unitCircle(int segs) {
+    if ((int)gUnitCircles.size() <= segs)
+        gUnitCircles.resize(segs + 1, NULL);
+    if (!gUnitCircles[segs]) {
+        UnitCircle* c = new UnitCircle();
+        c->cs.resize(segs + 1);
+        c->sn.resize(segs + 1);
+        for(int i = 0; i < segs; i++) {
+            double t = 2.0 * M_PI * i / segs;
+            c->cs[i] = (float)cos(t);
+            c->sn[i] = (float)sin(t);
+        }
+        // Close the ring exactly so adjacent fans share their edge
+        c->cs[segs] = c->cs[0];
+        c->sn[segs] = c->sn[0];
+        gUnitCircles[segs] = c;
+    }
+    return *gUnitCircles[segs];
+}
+
+// Build the tables for every segment count the scene uses
+void initUnitCircles() {
+    const int used[] = { 20, 24, 32, 36, 40, 48, 56, 60 };
+    for(size_t i = 0; i < sizeof(used) / sizeof(used[0]); i++)
+        unitCircle(used[i]);
+}
+
+// Scale and offset a unit circle into caller-provided rim arrays
+// (segs + 1 entries each, last one equal to the first)
+void circleRing(const UnitCircle& c, int segs, float cx, float cy,
+                float rx, float ry, float* __restrict outX, float* __restrict outY) {
+    const float* __restrict cs = &c.cs[0];
+    const float* __restrict sn = &c.sn[0];
+    for(int i = 0; i <= segs; i++) {
+        outX[i] = cx + cs[i] * rx;
+        outY[i] = cy + sn[i] * ry;
+    }
+}
+
+// ==================== GLOW SPRITES ====================
+
+// Soft glows are baked once into premultiplied RGBA textures and drawn
+// as one tinted quad instead of stacks of blended fans. A profile is a
+// list of elliptical layers composited back to front, each fading
+// linearly from its centre alpha to its rim alpha like the old fans.
+struct GlowLayer {
+    float rx, ry;
+    float r, g, b;
+    float centreA, rimA;
+};
+
+enum GlowId {
+    GLOW_RADIAL,           // unit radial glow (sun, headlight), kept under bloom
+    GLOW_LAMP,             // street lamp core + halos
+    GLOW_SIGNAL,           // signal lamp disc + glow, white for tinting
+    GLOW_COUNT
+};
+
+struct GlowSprite {
+    const GlowLayer* layers;
+    int count;
+    int core;               // leading layers that are the light itself
+    float extentX, extentY; // half size of the quad in profile units
+    GLuint tex;
+};
+
+const GlowLayer GLOW_RADIAL_LAYERS[] = {
+    { 1.0f, 1.0f,  1.0f, 1.0f, 1.0f,  0.35f, 0.04f }
+};
+
+const GlowLayer GLOW_LAMP_LAYERS[] = {
+    { 7.5f, 6.0f,    1.0f, 0.99f, 0.88f,  1.0f, 1.0f },   // core
+    { 16.0f, 12.0f,  1.0f, 0.93f, 0.72f,  0.55f, 0.55f }, // mid halo
+    { 30.0f, 20.0f,  1.0f, 0.86f, 0.55f,  0.26f, 0.26f }, // outer halo
+    { 60.0f, 60.0f,  1.0f, 0.85f, 0.50f,  0.35f, 0.04f }  // wide glow
+};
+
+const GlowLayer GLOW_SIGNAL_LAYERS[] = {
+    { 6.8f, 6.8f,    1.0f, 1.0f, 1.0f,  1.0f, 1.0f },
+    { 36.0f, 36.0f,  1.0f, 1.0f, 1.0f,  0.35f, 0.04f }
+};
+
+GlowSprite gGlows[GLOW_COUNT] = {
+    { GLOW_RADIAL_LAYERS, 1, 1, 1.0f, 1.0f, 0 },
+    { GLOW_LAMP_LAYERS, 4, 2, 60.0f, 60.0f, 0 },
+    { GLOW_SIGNAL_LAYERS, 2, 1, 36.0f, 36.0f, 0 }
+};
+
+// Halo layers are left out of the sprites while bloom provides them. The
+// radial glow counts as core: the sun and headlight are too dim to pass
+// the bloom threshold, so bloom would not replace it
+bool gLightHalos = true;
+
+const int GLOW_SPRITE_SIZE = 128;  // texels per side
+const int GLOW_SUPERSAMPLE = 4;    // per axis, for the layer edges
+
+// Premultiplied colour of a profile's first n layers at one point
+void glowSample(const GlowSprite& s, int n, float px, float py, float out[4]) {
+    out[0] = out[1] = out[2] = out[3] = 0.0f;
+    for(int i = 0; i < n; i++) {
+        const GlowLayer& L = s.layers[i];
+        float dx = px / L.rx, dy = py / L.ry;
+        float d = sqrtf(dx * dx + dy * dy);
+        if (d >= 1.0f) continue;
+        float a = L.centreA + (L.rimA - L.centreA) * d;
+        out[0] = L.r * a + out[0] * (1.0f - a);
+        out[1] = L.g * a + out[1] * (1.0f - a);
+        out[2] = L.b * a + out[2] * (1.0f - a);
+        out[3] = a + out[3] * (1.0f - a);
+    }
+}
+
+// Bake the first `layers` layers of a profile into its texture
+void bakeGlowSprite(GlowSprite& s, int layers) {
+    const int n = GLOW_SPRITE_SIZE, ss = GLOW_SUPERSAMPLE;
+    std::vector<unsigned char> texels(n * n * 4);
+    for(int y = 0; y < n; y++) {
+        for(int x = 0; x < n; x++) {
+            float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+            for(int sy = 0; sy < ss; sy++) {
+                for(int sx = 0; sx < ss; sx++) {
+                    float u = (x + (sx + 0.5f) / ss) / n * 2.0f - 1.0f;
+                    float v = (y + (sy + 0.5f) / ss) / n * 2.0f - 1.0f;
+                    float c[4];
+                    glowSample(s, layers, u * s.extentX, v * s.extentY, c);
+                    for(int k = 0; k < 4; k++) sum[k] += c[k];
+                }
+            }
+            unsigned char* t = &texels[(y * n + x) * 4];
+            for(int k = 0; k < 4; k++)
+                t[k] = (unsigned char)(sum[k] / (ss * ss) * 255.0f + 0.5f);
+        }
+    }
+    if (!s.tex) s.tex = createTexture(n, n, true, &texels[0]);
+    else updateTexture(s.tex, 0, 0, n, n, &texels[0]);
+}
+
+// Bake every glow profile into its texture
+void initGlowSprites() {
+    for(int id = 0; id < GLOW_COUNT; id++)
+        bakeGlowSprite(gGlows[id], gGlows[id].count);
+}
+
+// Re-bake the sprites with or without their halo layers. Textures are
+// updated in place, so meshes that captured them follow along.
+void setLightHalos(bool on) {
+    gLightHalos = on;
+    for(int id = 0; id < GLOW_COUNT; id++)
+        bakeGlowSprite(gGlows[id], on ? gGlows[id].count : gGlows[id].core);
+}
+
+// Draw a glow profile centred at (cx, cy), scaled per axis and tinted
+void drawGlowSprite(GlowId id, float cx, float cy, float sx, float sy,
+                    float r = 1, float g = 1, float b = 1, float a = 1.0f) {
+    const GlowSprite& s = gGlows[id];
+    if (!gLightHalos && s.core == 0) return;
+    float w = s.extentX * sx, h = s.extentY * sy;
+    float x0 = cx - w, x1 = cx + w, y0 = cy - h, y1 = cy + h;
+    batchBegin(BATCH_TRIANGLES, s.tex, BLEND_PREMULTIPLIED);
+    // Premultiplied tint
+    r *= a; g *= a; b *= a;
+    batchVertexUV(x0, y0, 0.0f, 0.0f, r, g, b, a);
+    batchVertexUV(x1, y0, 1.0f, 0.0f, r, g, b, a);
+    batchVertexUV(x1, y1, 1.0f, 1.0f, r, g, b, a);
+    batchVertexUV(x0, y0, 0.0f, 0.0f, r, g, b, a);
+    batchVertexUV(x1, y1, 1.0f, 1.0f, r, g, b, a);
+    batchVertexUV(x0, y1, 0.0f, 1.0f, r, g, b, a);
+    if (gHeadless) {
+        // The software renderer evaluates the profile instead of the texture
+        for(size_t i = gBatch.verts.size() - 6; i < gBatch.verts.size(); i++)
+            gBatch.verts[i].shape = SHAPE_SPRITE + id;
+    }
+}
+
+// ==================== SPAN KERNELS ====================
+
+// Constant-colour spans (rects, windows, bridge, streaks: most of the
+// scene) are filled or src-over blended a row at a time by one of the
+// kernel sets below, picked at startup from what the CPU supports.
+// Every set does the same 8.8 fixed-point arithmetic, so they produce
+// identical pixels:
+//   out = min(255, (S + dst * inv + 128) >> 8)
+// with S the source term premultiplied by 255 * 256 and inv = 256 - 256 * alpha.
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SPAN_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SPAN_SSE2_TARGET
+#define SPAN_AVX2_TARGET
+#else
+#if defined(__x86_64__)
+#define SPAN_SSE2_TARGET
+#else
+#define SPAN_SSE2_TARGET __attribute__((target("sse2")))   // i386 may lack it
+#endif
+#define SPAN_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+// Source colour of a span, ready for the kernels
+struct SpanColor {
+    unsigned int packed;       // RGBA8 for plain fills
+    unsigned short s[4];       // source term per channel
+    unsigned short inv;        // destination factor, 0..256
+};
+
+struct SpanKernels {
+    const char* name;
+    void (*fill)(unsigned char* d, int n, const SpanColor& c);
+    void (*blend)(unsigned char* d, int n, const SpanColor& c);
+};
+
+void spanFillScalar(unsigned char* d, int n, const SpanColor& c) {
+    for(int i = 0; i < n; i++) memcpy(d + i * 4, &c.packed, 4);
+}
+
+void spanBlendScalar(unsigned char* d, int n, const SpanColor& c) {
+    for(int i = 0; i < n * 4; i++) {
+        unsigned v = c.s[i & 3] + d[i] * (unsigned)c.inv + 128;
+        d[i] = (unsigned char)(std::min(v, 65535u) >> 8);
+    }
+}
+
+#ifdef SPAN_X86
+SPAN_SSE2_TARGET
+void spanFillSSE2(unsigned char* d, int n, const SpanColor& c) {
+    __m128i v = _mm_set1_epi32((int)c.packed);
+    int i = 0;
+    for(; i + 4 <= n; i += 4) _mm_storeu_si128((__m128i*)(d + i * 4), v);
+    spanFillScalar(d + i * 4, n - i, c);
+}
+
+// 16-bit lanes: dst * inv fits, the sums saturate like the min() above
+SPAN_SSE2_TARGET
+void spanBlendSSE2(unsigned char* d, int n, const SpanColor& c) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i inv = _mm_set1_epi16((short)c.inv);
+    __m128i round = _mm_set1_epi16(128);
+    __m128i s = _mm_setr_epi16((short)c.s[0], (short)c.s[1], (short)c.s[2], (short)c.s[3],
+                               (short)c.s[0], (short)c.s[1], (short)c.s[2], (short)c.s[3]);
+    int i = 0;
+    for(; i + 4 <= n; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i*)(d + i * 4));
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(px, zero), inv);
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), inv);
+        lo = _mm_srli_epi16(_mm_adds_epu16(_mm_adds_epu16(lo, s), round), 8);
+        hi = _mm_srli_epi16(_mm_adds_epu16(_mm_adds_epu16(hi, s), round), 8);
+        _mm_storeu_si128((__m128i*)(d + i * 4), _mm_packus_epi16(lo, hi));
+    }
+    spanBlendScalar(d + i * 4, n - i, c);
+}
+
+SPAN_AVX2_TARGET
+void spanFillAVX2(unsigned char* d, int n, const SpanColor& c) {
+    __m256i v = _mm256_set1_epi32((int)c.packed);
+    int i = 0;
+    for(; i + 8 <= n; i += 8) _mm256_storeu_si256((__m256i*)(d + i * 4), v);
+    spanFillSSE2(d + i * 4, n - i, c);
+}
+
+SPAN_AVX2_TARGET
+void spanBlendAVX2(unsigned char* d, int n, const SpanColor& c) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i inv = _mm256_set1_epi16((short)c.inv);
+    __m256i round = _mm256_set1_epi16(128);
+    __m256i s = _mm256_set1_epi64x((long long)c.s[0] | (long long)c.s[1] << 16 |
+                                   (long long)c.s[2] << 32 | (long long)c.s[3] << 48);
+    int i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i*)(d + i * 4));
+        __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(px, zero), inv);
+        __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(px, zero), inv);
+        lo = _mm256_srli_epi16(_mm256_adds_epu16(_mm256_adds_epu16(lo, s), round), 8);
+        hi = _mm256_srli_epi16(_mm256_adds_epu16(_mm256_adds_epu16(hi, s), round), 8);
+        _mm256_storeu_si256((__m256i*)(d + i * 4), _mm256_packus_epi16(lo, hi));
+    }
+    spanBlendSSE2(d + i * 4, n - i, c);
+}
+
+// SSE2 is part of every x86-64 CPU; 32-bit x86 has to ask (cpuid 1, EDX.26)
+bool cpuHasSSE2() {
+#if defined(__x86_64__) || defined(_M_X64)
+    return true;
+#elif defined(_MSC_VER)
+    int r[4];
+    __cpuid(r, 1);
+    return (r[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+// AVX2 needs the instructions and the OS saving the ymm registers
+bool cpuHasAVX2() {
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7) return false;
+    __cpuid(r, 1);
+    if (!(r[2] & (1 << 27)) || !(r[2] & (1 << 28))) return false;   // OSXSAVE, AVX
+    if ((_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+// Fastest first
+const SpanKernels SPAN_KERNELS[] = {
+#ifdef SPAN_X86
+    { "avx2",   spanFillAVX2,   spanBlendAVX2 },
+    { "sse2",   spanFillSSE2,   spanBlendSSE2 },
+#endif
+    { "scalar", spanFillScalar, spanBlendScalar }
+};
+
+const int SPAN_KERNEL_COUNT = sizeof(SPAN_KERNELS) / sizeof(SPAN_KERNELS[0]);
+
+const SpanKernels* gSpan = &SPAN_KERNELS[SPAN_KERNEL_COUNT - 1];
+
+// True if this CPU can run a kernel set
+bool spanSupported(const SpanKernels& k) {
+#ifdef SPAN_X86
+    if (strcmp(k.name, "avx2") == 0) return cpuHasAVX2();
+    if (strcmp(k.name, "sse2") == 0) return cpuHasSSE2();
+#endif
+    (void)k;
+    return true;
+}
+
+// Pick the fastest supported set, or the named one if it is supported
+void selectSpanKernels(const char* name) {
+    for(int i = 0; i < SPAN_KERNEL_COUNT; i++) {
+        if (name && strcmp(SPAN_KERNELS[i].name, name) != 0) continue;
+        if (!spanSupported(SPAN_KERNELS[i])) continue;
+        gSpan = &SPAN_KERNELS[i];
+        return;
+    }
+    if (name) {
+        fprintf(stderr, "span kernels \"%s\" not available here\n", name);
+        selectSpanKernels(NULL);
+    }
+}
+
+// Source term of a straight or premultiplied colour (0..1 floats)
+SpanColor spanColor(const float c[4], bool premultiplied) {
+    SpanColor o;
+    unsigned char b[4];
+    float a = std::max(0.0f, std::min(1.0f, c[3]));
+    float sf = premultiplied ? 1.0f : a;
+    for(int k = 0; k < 4; k++) {
+        float v = std::max(0.0f, std::min(1.0f, c[k]));
+        b[k] = (unsigned char)(v * 255.0f + 0.5f);
+        float s = (k == 3 ? a : std::max(0.0f, c[k]) * sf) * 255.0f * 256.0f;
+        o.s[k] = (unsigned short)std::min(65535.0f, s + 0.5f);
+    }
+    memcpy(&o.packed, b, 4);
+    o.inv = (unsigned short)(256 - (int)(a * 256.0f + 0.5f));
+    return o;
+}
+
+// --bench-spans: fill and blend rows of a 1920x1080 buffer with every
+// kernel set this CPU supports and report pixels per second
+void benchSpans() {
+    const int w = 1920, h = 1080, passes = 20;
+    std::vector<unsigned char> ref, buf((size_t)w * h * 4);
+    float colour[4] = { 0.95f, 0.75f, 0.45f, 0.3f };
+    SpanColor c = spanColor(colour, false);
+    fprintf(stderr, "kernels   fill Mpx/s  blend Mpx/s\n");
+    for(int i = SPAN_KERNEL_COUNT - 1; i >= 0; i--) {
+        const SpanKernels& k = SPAN_KERNELS[i];
+        if (!spanSupported(k)) {
+            fprintf(stderr, "%-8s  (not supported)\n", k.name);
+            continue;
+        }
+        double rate[2];
+        for(int op = 0; op < 2; op++) {
+            for(size_t j = 0; j < buf.size(); j++) buf[j] = (unsigned char)(j * 7);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for(int p = 0; p < passes; p++)
+                for(int y = 0; y < h; y++) {
+                    // Odd offsets and widths exercise the unaligned tails
+                    int x0 = (y + p) % 7, n = w - x0 - (y % 5);
+                    unsigned char* d = &buf[((size_t)y * w + x0) * 4];
+                    if (op == 0) k.fill(d, n, c);
+                    else k.blend(d, n, c);
+                }
+            double secs = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+            rate[op] = (double)w * h * passes / std::max(secs, 1e-9) / 1e6;
+        }
+        bool same = ref.empty() || ref == buf;
+        if (ref.empty()) ref = buf;
+        fprintf(stderr, "%-8s %11.0f %12.0f%s\n", k.name, rate[0], rate[1],
+                same ? "" : "  MISMATCH against scalar");
+    }
+}
+
+// ==================== SOFTWARE RENDERER ====================
+
+// --headless draws without GL: batchDraw hands every draw to softDraw,
+// which rasterizes into an RGBA8 frame in memory (rows bottom-up like a
+// GL framebuffer, at the render size). Triangles are filled at pixel
+// centres with interpolated colour and texcoords, the texel modulating
+// the colour as in the fixed-function path. Lines become quads and
+// points squares, sized like the GL ones.
+//
+// Draws are not rasterized straight away. softDraw sets each primitive
+// up once and bins it into the SOFT_TILE-sized tiles its bounds touch;
+// softFlush then rasterizes the tiles in parallel, each tile walking its
+// own command list in submission order. Tiles own disjoint pixels, so
+// blending within a tile happens in draw order and the frame is the
+// same for any number of threads.
+const int SOFT_TILE = 64;
+const int SOFT_BLOCK = 8;        // trivial accept/reject granularity
+const int SOFT_SUBPIXEL = 256;   // fixed-point steps per pixel
+const int SOFT_ATTRS = 6;        // r, g, b, a, u, v
+
+// Edge function over subpixel coordinates: E = a * x + b * y + c,
+// E >= 0 inside, with the fill-rule bias folded into c
+struct SoftEdge {
+    long long a, b, c;
+};
+
+// Floor of n / d for d > 0
+inline long long softFloorDiv(long long n, long long d) {
+    return n >= 0 ? n / d : -((-n + d - 1) / d);
+}
+
+enum SoftPrimKind {
+    SOFT_TRIANGLE,
+    SOFT_RECT,                // point square, colour c[0..3]
+    SOFT_ELLIPSE              // analytic layers, premultiplied tint c[0..3]
+};
+
+// One binned primitive. Attributes are planes over pixel coordinates:
+// value = c + dx * x + dy * y, evaluated at pixel centres. Untextured
+// primitives of one colour are `flat` and go through the span kernels.
+struct SoftPrim {
+    SoftPrimKind kind;
+    bool flat;
+    SpanColor span;           // colour for the span kernels when flat
+    int x0, y0, x1, y1;       // covered pixel bounds, half-open
+    SoftEdge edge[3];         // triangle edges, counter-clockwise
+    float cx, cy;             // ellipse centre in pixels
+    int layer0, layers;       // its profile in gSoft.layers
+    float c[SOFT_ATTRS], dx[SOFT_ATTRS], dy[SOFT_ATTRS];
+    BlendMode blend;
+    const SoftTexture* tex;
+};
+
+struct SoftFrame {
+    int w, h;
+    int ox, oy;               // scene viewport corner, letterboxed like reshape
+    std::vector<unsigned char> pixels;
+    SpanColor clear;          // colour each tile starts from
+    bool clearPending;        // set by softClear until the first flush
+    int tilesX, tilesY;
+    std::vector<SoftPrim> prims;
+    std::vector<GlowLayer> layers;          // ellipse profiles, radii in pixels
+    std::vector<std::vector<int> > tiles;   // prim indices per tile
+    std::atomic<int> nextTile;              // next tile to hand out
+    int binned, flushes;      // tile commands and flushes this frame
+};
+
+SoftFrame gSoft;
+
+// Workers that rasterize tiles alongside the calling thread
+struct SoftPool {
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake, done;
+    unsigned job;             // bumped for every flush
+    int busy;                 // workers still on the current job
+    bool quit;
+};
+
+SoftPool gSoftPool;
+
+// Start a frame at the requested size with the scene letterboxed in it;
+// the fill itself happens per tile and also paints the bars
+void softClear(float r, float g, float b, float a) {
+    int w = std::max(gRenderW, (int)(gWindowW * gRenderScale + 0.5f));
+    int h = std::max(gRenderH, (int)(gWindowH * gRenderScale + 0.5f));
+    gSoft.ox = (w - gRenderW) / 2;
+    gSoft.oy = (h - gRenderH) / 2;
+    if (gSoft.w != w || gSoft.h != h) {
+        gSoft.w = w;
+        gSoft.h = h;
+        gSoft.pixels.resize((size_t)gSoft.w * gSoft.h * 4);
+        gSoft.tilesX = (gSoft.w + SOFT_TILE - 1) / SOFT_TILE;
+        gSoft.tilesY = (gSoft.h + SOFT_TILE - 1) / SOFT_TILE;
+        gSoft.tiles.assign(gSoft.tilesX * gSoft.tilesY, std::vector<int>());
+    }
+    float c[4] = { r, g, b, a };
+    gSoft.clear = spanColor(c, false);
+    gSoft.clearPending = true;
+    gSoft.binned = 0;
+    gSoft.flushes = 0;
+}
+
+// Clamp-to-edge texture lookup, nearest or bilinear
+void softSample(const SoftTexture& t, float u, float v, float out[4]) {
+    if (!t.linear) {
+        int x = std::max(0, std::min(t.w - 1, (int)floorf(u * t.w)));
+        int y = std::max(0, std::min(t.h - 1, (int)floorf(v * t.h)));
+        const unsigned char* p = &t.texels[((size_t)y * t.w + x) * 4];
+        for(int k = 0; k < 4; k++) out[k] = p[k] * (1.0f / 255.0f);
+        return;
+    }
+    float fx = u * t.w - 0.5f, fy = v * t.h - 0.5f;
+    int x0 = (int)floorf(fx), y0 = (int)floorf(fy);
+    float ax = fx - x0, ay = fy - y0;
+    int x1 = std::max(0, std::min(t.w - 1, x0 + 1));
+    int y1 = std::max(0, std::min(t.h - 1, y0 + 1));
+    x0 = std::max(0, std::min(t.w - 1, x0));
+    y0 = std::max(0, std::min(t.h - 1, y0));
+    const unsigned char* p00 = &t.texels[((size_t)y0 * t.w + x0) * 4];
+    const unsigned char* p10 = &t.texels[((size_t)y0 * t.w + x1) * 4];
+    const unsigned char* p01 = &t.texels[((size_t)y1 * t.w + x0) * 4];
+    const unsigned char* p11 = &t.texels[((size_t)y1 * t.w + x1) * 4];
+    for(int k = 0; k < 4; k++) {
+        float a = p00[k] + (p10[k] - p00[k]) * ax;
+        float b = p01[k] + (p11[k] - p01[k]) * ax;
+        out[k] = (a + (b - a) * ay) * (1.0f / 255.0f);
+    }
+}
+
+// Blend one colour into a pixel with the same factors as applyBatchState
+// (destination alpha kept as coverage, like the offscreen layers)
+inline void softBlend(unsigned char* d, const float s[4], BlendMode mode) {
+    if (mode == BLEND_OFF) {
+        for(int k = 0; k < 4; k++) d[k] = packUnorm(s[k]);
+        return;
+    }
+    float sa = std::max(0.0f, std::min(1.0f, s[3]));
+    float sf = mode == BLEND_PREMULTIPLIED ? 1.0f : sa;
+    float df = (1.0f - sa) * (1.0f / 255.0f);
+    for(int k = 0; k < 3; k++) d[k] = packUnorm(s[k] * sf + d[k] * df);
+    d[3] = packUnorm(sa + d[3] * df);
+}
+
+// A vertex mapped to pixels: position, then the attributes
+struct SoftVertex {
+    float x, y;
+    float attr[SOFT_ATTRS];
+};
+
+SoftVertex softVertex(const BatchVertex& v, float sx, float sy) {
+    SoftVertex o = { v.x * sx + gSoft.ox, v.y * sy + gSoft.oy,
+                     { v.r, v.g, v.b, v.a, v.u, v.v } };
+    return o;
+}
+
+// Add a primitive to the command list of every tile its bounds touch,
+// clipped to the scene viewport
+void softBin(SoftPrim& p) {
+    if (p.flat) p.span = spanColor(p.c, p.blend == BLEND_PREMULTIPLIED);
+    p.x0 = std::max(gSoft.ox, p.x0);
+    p.y0 = std::max(gSoft.oy, p.y0);
+    p.x1 = std::min(gSoft.ox + gRenderW, p.x1);
+    p.y1 = std::min(gSoft.oy + gRenderH, p.y1);
+    if (p.x0 >= p.x1 || p.y0 >= p.y1) return;
+    int index = (int)gSoft.prims.size();
+    gSoft.prims.push_back(p);
+    for(int ty = p.y0 / SOFT_TILE; ty <= (p.y1 - 1) / SOFT_TILE; ty++)
+        for(int tx = p.x0 / SOFT_TILE; tx <= (p.x1 - 1) / SOFT_TILE; tx++) {
+            gSoft.tiles[ty * gSoft.tilesX + tx].push_back(index);
+            gSoft.binned++;
+        }
+}
+
+// Set up a triangle for the half-space rasterizer, then bin it. Corners
+// snap to SOFT_SUBPIXEL steps; the edge functions are exact integers
+// from then on, so triangles sharing an edge agree on every pixel.
+void softTriangle(const SoftVertex& a, const SoftVertex& b, const SoftVertex& c,
+                  BlendMode blend, const SoftTexture* tex) {
+    const SoftVertex* v[3] = { &a, &b, &c };
+    long long X[3], Y[3];
+    for(int i = 0; i < 3; i++) {
+        X[i] = llrintf(v[i]->x * SOFT_SUBPIXEL);
+        Y[i] = llrintf(v[i]->y * SOFT_SUBPIXEL);
+    }
+    long long area = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+    if (area == 0) return;
+    // Wind counter-clockwise so the inside is E >= 0 for every edge
+    if (area < 0) {
+        std::swap(X[1], X[2]);
+        std::swap(Y[1], Y[2]);
+    }
+
+    SoftPrim p;
+    p.kind = SOFT_TRIANGLE;
+    p.flat = !tex;
+    p.blend = blend;
+    p.tex = tex;
+    for(int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        long long dx = X[j] - X[i], dy = Y[j] - Y[i];
+        SoftEdge& e = p.edge[i];
+        e.a = -dy;
+        e.b = dx;
+        e.c = dy * X[i] - dx * Y[i];
+        // Top-left rule: a pixel centre exactly on the edge belongs to
+        // this triangle only for a left edge (inside to its right) or a
+        // top edge (horizontal, inside below); its neighbour takes the rest
+        if (!(dy < 0 || (dy == 0 && dx < 0))) e.c -= 1;
+    }
+
+    float e1x = b.x - a.x, e1y = b.y - a.y;
+    float e2x = c.x - a.x, e2y = c.y - a.y;
+    float farea = e1x * e2y - e2x * e1y;
+    for(int k = 0; k < SOFT_ATTRS; k++) {
+        float d1 = b.attr[k] - a.attr[k], d2 = c.attr[k] - a.attr[k];
+        p.dx[k] = farea != 0.0f ? (d1 * e2y - d2 * e1y) / farea : 0.0f;
+        p.dy[k] = farea != 0.0f ? (d2 * e1x - d1 * e2x) / farea : 0.0f;
+        p.c[k] = a.attr[k] - p.dx[k] * a.x - p.dy[k] * a.y;
+        if (k < 4 && (p.dx[k] != 0.0f || p.dy[k] != 0.0f)) p.flat = false;
+    }
+
+    // Pixels whose centres lie within the snapped corners
+    const long long half = SOFT_SUBPIXEL / 2;
+    p.x0 = (int)-softFloorDiv(half - std::min(X[0], std::min(X[1], X[2])), SOFT_SUBPIXEL);
+    p.x1 = (int)softFloorDiv(std::max(X[0], std::max(X[1], X[2])) - half, SOFT_SUBPIXEL) + 1;
+    p.y0 = (int)-softFloorDiv(half - std::min(Y[0], std::min(Y[1], Y[2])), SOFT_SUBPIXEL);
+    p.y1 = (int)softFloorDiv(std::max(Y[0], std::max(Y[1], Y[2])) - half, SOFT_SUBPIXEL) + 1;
+    softBin(p);
+}
+
+// Fill or blend n pixels of a flat primitive
+inline void softSpan(const SoftPrim& p, unsigned char* d, int n) {
+    if (p.blend == BLEND_OFF) gSpan->fill(d, n, p.span);
+    else gSpan->blend(d, n, p.span);
+}
+
+// Shade pixels [x0, x1) of row y. Attributes come from the planes at
+// each pixel centre, never stepped from the clip box, so every tile
+// produces the bits a single pass would.
+void softShadeSpan(const SoftPrim& p, int y, int x0, int x1) {
+    unsigned char* d = &gSoft.pixels[((size_t)y * gSoft.w + x0) * 4];
+    if (p.flat) {
+        softSpan(p, d, x1 - x0);
+        return;
+    }
+    float yc = y + 0.5f;
+    float row[SOFT_ATTRS];
+    for(int k = 0; k < SOFT_ATTRS; k++) row[k] = p.c[k] + p.dy[k] * yc;
+    for(int x = x0; x < x1; x++, d += 4) {
+        float xc = x + 0.5f;
+        float s[4];
+        for(int k = 0; k < 4; k++) s[k] = row[k] + p.dx[k] * xc;
+        if (p.tex) {
+            float t[4];
+            softSample(*p.tex, row[4] + p.dx[4] * xc, row[5] + p.dx[5] * xc, t);
+            for(int k = 0; k < 4; k++) s[k] *= t[k];
+        }
+        softBlend(d, s, p.blend);
+    }
+}
+
+// Edge function at the centre of pixel (x, y)
+inline long long softEdgeAt(const SoftEdge& e, int x, int y) {
+    return e.a * (x * SOFT_SUBPIXEL + SOFT_SUBPIXEL / 2) +
+           e.b * (y * SOFT_SUBPIXEL + SOFT_SUBPIXEL / 2) + e.c;
+}
+
+// Fill a triangle's pixels within the clip box. The box is walked in
+// SOFT_BLOCK-square blocks: testing the edge functions at a block's four
+// corner pixels rejects it when all lie outside one edge and accepts it
+// whole when all lie inside every edge (the edges are linear, so the
+// pixels between follow). Only blocks straddling an edge test each
+// pixel. Covered pixels of a row are contiguous in a triangle, so each
+// row is shaded as one span across its blocks.
+void softRasterTriangle(const SoftPrim& p, int cx0, int cy0, int cx1, int cy1) {
+    enum { BLOCK_OUT, BLOCK_IN, BLOCK_PARTIAL };
+    const int maxBlocks = SOFT_TILE / SOFT_BLOCK + 1;
+    int x0 = std::max(p.x0, cx0), x1 = std::min(p.x1, cx1);
+    int y0 = std::max(p.y0, cy0), y1 = std::min(p.y1, cy1);
+    if (x0 >= x1 || y0 >= y1) return;
+    int bxFirst = x0 - x0 % SOFT_BLOCK;
+    int blocks = std::min(maxBlocks, (x1 - bxFirst + SOFT_BLOCK - 1) / SOFT_BLOCK);
+
+    for(int by = y0 - y0 % SOFT_BLOCK; by < y1; by += SOFT_BLOCK) {
+        int by0 = std::max(by, y0), by1 = std::min(by + SOFT_BLOCK, y1);
+        unsigned char state[maxBlocks];
+        for(int i = 0; i < blocks; i++) {
+            int bx0 = std::max(bxFirst + i * SOFT_BLOCK, x0);
+            int bx1 = std::min(bxFirst + (i + 1) * SOFT_BLOCK, x1);
+            state[i] = BLOCK_IN;
+            for(int k = 0; k < 3; k++) {
+                const SoftEdge& e = p.edge[k];
+                long long e00 = softEdgeAt(e, bx0, by0);
+                long long ex = e.a * SOFT_SUBPIXEL * (bx1 - 1 - bx0);
+                long long ey = e.b * SOFT_SUBPIXEL * (by1 - 1 - by0);
+                int inside = (e00 >= 0) + (e00 + ex >= 0) +
+                             (e00 + ey >= 0) + (e00 + ex + ey >= 0);
+                if (inside == 0) {
+                    state[i] = BLOCK_OUT;
+                    break;
+                }
+                if (inside < 4) state[i] = BLOCK_PARTIAL;
+            }
+        }
+
+        for(int y = by0; y < by1; y++) {
+            int runX0 = 0, runX1 = 0;   // covered pixels found so far
+            for(int i = 0; i < blocks; i++) {
+                if (state[i] == BLOCK_OUT) continue;
+                int bx0 = std::max(bxFirst + i * SOFT_BLOCK, x0);
+                int bx1 = std::min(bxFirst + (i + 1) * SOFT_BLOCK, x1);
+                int s0 = bx0, s1 = bx1;
+                if (state[i] == BLOCK_PARTIAL) {
+                    long long e[3], step[3];
+                    for(int k = 0; k < 3; k++) {
+                        e[k] = softEdgeAt(p.edge[k], bx0, y);
+                        step[k] = p.edge[k].a * SOFT_SUBPIXEL;
+                    }
+                    s0 = s1 = bx1;
+                    for(int x = bx0; x < bx1; x++) {
+                        bool in = e[0] >= 0 && e[1] >= 0 && e[2] >= 0;
+                        if (in && s0 == bx1) s0 = x;
+                        if (!in && s0 != bx1) {
+                            s1 = x;
+                            break;
+                        }
+                        for(int k = 0; k < 3; k++) e[k] += step[k];
+                    }
+                    if (s0 == s1) continue;
+                }
+                if (runX1 == s0 && runX0 < runX1) {
+                    runX1 = s1;
+                } else {
+                    if (runX0 < runX1) softShadeSpan(p, y, runX0, runX1);
+                    runX0 = s0;
+                    runX1 = s1;
+                }
+            }
+            if (runX0 < runX1) softShadeSpan(p, y, runX0, runX1);
+        }
+    }
+}
+
+// Fill a point square's pixels within the clip box
+void softRasterRect(const SoftPrim& p, int cx0, int cy0, int cx1, int cy1) {
+    int x0 = std::max(p.x0, cx0), x1 = std::min(p.x1, cx1);
+    int y0 = std::max(p.y0, cy0), y1 = std::min(p.y1, cy1);
+    if (x0 >= x1) return;
+    for(int y = y0; y < y1; y++)
+        softSpan(p, &gSoft.pixels[((size_t)y * gSoft.w + x0) * 4], x1 - x0);
+}
+
+// Composite an ellipse's layers at offset (dx, dy) from its centre and
+// tint the result (premultiplied). Each layer fades linearly from its
+// centre alpha to its rim alpha like the baked sprites, and its rim is
+// antialiased over the pixel footprint of the normalized radius, as the
+// shader does with fwidth.
+void softEllipseSample(const SoftPrim& p, float dx, float dy, float out[4]) {
+    out[0] = out[1] = out[2] = out[3] = 0.0f;
+    for(int i = 0; i < p.layers; i++) {
+        const GlowLayer& L = gSoft.layers[p.layer0 + i];
+        float u = dx / L.rx, v = dy / L.ry;
+        float d = sqrtf(u * u + v * v);
+        float aa = d > 1e-6f ? sqrtf(u * u / (L.rx * L.rx) + v * v / (L.ry * L.ry)) / d
+                             : 1.0f / std::min(L.rx, L.ry);
+        float cover = std::max(0.0f, std::min(1.0f, (1.0f - d) / aa + 0.5f));
+        if (cover <= 0.0f) continue;
+        float a = (L.centreA + (L.rimA - L.centreA) * std::min(d, 1.0f)) * cover;
+        out[0] = L.r * a + out[0] * (1.0f - a);
+        out[1] = L.g * a + out[1] * (1.0f - a);
+        out[2] = L.b * a + out[2] * (1.0f - a);
+        out[3] = a + out[3] * (1.0f - a);
+    }
+    for(int k = 0; k < 4; k++) out[k] *= p.c[k];
+}
+
+// Shade an ellipse's pixels within the clip box. Each row only visits
+// the chord of the widest layer, solved from the ellipse equation and
+// padded by a pixel for the antialiased rim, so the cost follows the
+// covered area rather than the bounding box.
+void softRasterEllipse(const SoftPrim& p, int cx0, int cy0, int cx1, int cy1) {
+    int y0 = std::max(p.y0, cy0), y1 = std::min(p.y1, cy1);
+    for(int y = y0; y < y1; y++) {
+        float dy = y + 0.5f - p.cy;
+        float half = -1.0f;
+        for(int i = 0; i < p.layers; i++) {
+            const GlowLayer& L = gSoft.layers[p.layer0 + i];
+            float rx = L.rx + 1.0f, ry = L.ry + 1.0f;
+            float t = dy / ry;
+            if (t * t < 1.0f) half = std::max(half, rx * sqrtf(1.0f - t * t));
+        }
+        if (half < 0.0f) continue;
+        int x0 = std::max(std::max(cx0, p.x0), (int)ceilf(p.cx - half - 0.5f));
+        int x1 = std::min(std::min(cx1, p.x1), (int)ceilf(p.cx + half - 0.5f));
+        unsigned char* d = &gSoft.pixels[((size_t)y * gSoft.w + x0) * 4];
+        for(int x = x0; x < x1; x++, d += 4) {
+            float s[4];
+            softEllipseSample(p, x + 0.5f - p.cx, dy, s);
+            if (s[3] > 0.0f) softBlend(d, s, p.blend);
+        }
+    }
+}
+
+// Bin an ellipse quad (SHAPE_ELLIPSE / SHAPE_GLOW from batchEllipseQuad,
+// SHAPE_SPRITE from drawGlowSprite) as one analytic ellipse. Centre and
+// radii come back out of the corners' positions and quad coordinates,
+// so instance transforms applied to the vertices carry over.
+void softEllipse(const BatchVertex* q, float sx, float sy, BlendMode blend) {
+    const BatchVertex& a = q[0];
+    const BatchVertex& b = q[2];
+    if (b.u == a.u || b.v == a.v) return;
+    float ux = (b.x - a.x) / (b.u - a.u) * sx;   // pixels per unit of u, v
+    float vy = (b.y - a.y) / (b.v - a.v) * sy;
+
+    SoftPrim p;
+    p.kind = SOFT_ELLIPSE;
+    p.flat = false;
+    p.tex = NULL;
+    p.layer0 = (int)gSoft.layers.size();
+    float extentX = 0.0f, extentY = 0.0f;   // widest layer, rim included
+    if (a.shape >= SHAPE_SPRITE) {
+        // The sprite's quad spans u, v in 0..1 over +-extent profile units
+        const GlowSprite& s = gGlows[(int)(a.shape - SHAPE_SPRITE + 0.5f)];
+        float kx = fabsf(ux) / (2.0f * s.extentX), ky = fabsf(vy) / (2.0f * s.extentY);
+        p.cx = a.x * sx + gSoft.ox + (0.5f - a.u) * ux;
+        p.cy = a.y * sy + gSoft.oy + (0.5f - a.v) * vy;
+        p.layers = gLightHalos ? s.count : s.core;
+        for(int i = 0; i < p.layers; i++) {
+            GlowLayer L = s.layers[i];
+            L.rx *= kx;
+            L.ry *= ky;
+            gSoft.layers.push_back(L);
+        }
+        p.blend = blend;
+        p.c[0] = a.r; p.c[1] = a.g; p.c[2] = a.b; p.c[3] = a.a;
+    } else {
+        // A unit disc in u, v; the vertex colour is the straight tint
+        float ratio = a.shape >= SHAPE_GLOW ? a.shape - SHAPE_GLOW : 1.0f;
+        GlowLayer L = { fabsf(ux), fabsf(vy), 1.0f, 1.0f, 1.0f, 1.0f, ratio };
+        p.cx = a.x * sx + gSoft.ox - a.u * ux;
+        p.cy = a.y * sy + gSoft.oy - a.v * vy;
+        p.layers = 1;
+        gSoft.layers.push_back(L);
+        p.blend = BLEND_PREMULTIPLIED;
+        p.c[0] = a.r * a.a; p.c[1] = a.g * a.a; p.c[2] = a.b * a.a; p.c[3] = a.a;
+    }
+    for(int i = 0; i < p.layers; i++) {
+        const GlowLayer& L = gSoft.layers[p.layer0 + i];
+        if (L.rx <= 0.0f || L.ry <= 0.0f) return;
+        extentX = std::max(extentX, L.rx + 1.0f);
+        extentY = std::max(extentY, L.ry + 1.0f);
+    }
+    if (p.layers == 0) return;
+    p.x0 = (int)ceilf(p.cx - extentX - 0.5f);
+    p.x1 = (int)ceilf(p.cx + extentX - 0.5f);
+    p.y0 = (int)ceilf(p.cy - extentY - 0.5f);
+    p.y1 = (int)ceilf(p.cy + extentY - 0.5f);
+    softBin(p);
+}
+
+// Clear one tile if the frame is new, then replay its command list
+void softRasterTile(int t) {
+    int cx0 = (t % gSoft.tilesX) * SOFT_TILE, cy0 = (t / gSoft.tilesX) * SOFT_TILE;
+    int cx1 = std::min(gSoft.w, cx0 + SOFT_TILE);
+    int cy1 = std::min(gSoft.h, cy0 + SOFT_TILE);
+    if (gSoft.clearPending) {
+        for(int y = cy0; y < cy1; y++)
+            gSpan->fill(&gSoft.pixels[((size_t)y * gSoft.w + cx0) * 4],
+                        cx1 - cx0, gSoft.clear);
+    }
+    const std::vector<int>& list = gSoft.tiles[t];
+    for(size_t i = 0; i < list.size(); i++) {
+        const SoftPrim& p = gSoft.prims[list[i]];
+        if (p.kind == SOFT_TRIANGLE) softRasterTriangle(p, cx0, cy0, cx1, cy1);
+        else if (p.kind == SOFT_RECT) softRasterRect(p, cx0, cy0, cx1, cy1);
+        else softRasterEllipse(p, cx0, cy0, cx1, cy1);
+    }
+}
+
+// Take tiles until none are left
+void softRunTiles() {
+    int count = gSoft.tilesX * gSoft.tilesY;
+    for(int t; (t = gSoft.nextTile++) < count; )
+        softRasterTile(t);
+}
+
+// Worker loop; `seen` is the job current when the worker was started
+void softWorker(unsigned seen) {
+    std::unique_lock<std::mutex> lk(gSoftPool.lock);
+    for(;;) {
+        while (gSoftPool.job == seen && !gSoftPool.quit) gSoftPool.wake.wait(lk);
+        if (gSoftPool.quit) return;
+        seen = gSoftPool.job;
+        lk.unlock();
+        softRunTiles();
+        lk.lock();
+        if (--gSoftPool.busy == 0) gSoftPool.done.notify_all();
+    }
+}
+
+// Rasterize with `threads` threads in all, counting the caller
+void softSetThreads(int threads) {
+    {
+        std::lock_guard<std::mutex> lk(gSoftPool.lock);
+        gSoftPool.quit = true;
+        gSoftPool.wake.notify_all();
+    }
+    for(size_t i = 0; i < gSoftPool.workers.size(); i++)
+        gSoftPool.workers[i].join();
+    gSoftPool.workers.clear();
+    gSoftPool.quit = false;
+    for(int i = 1; i < threads; i++)
+        gSoftPool.workers.push_back(std::thread(softWorker, gSoftPool.job));
+}
+
+// Rasterize everything binned so far and empty the tile lists
+void softFlush() {
+    if (gSoft.prims.empty() && !gSoft.clearPending) return;
+    gSoft.nextTile = 0;
+    int workers = (int)gSoftPool.workers.size();
+    if (workers) {
+        std::lock_guard<std::mutex> lk(gSoftPool.lock);
+        gSoftPool.busy = workers;
+        gSoftPool.job++;
+        gSoftPool.wake.notify_all();
+    }
+    softRunTiles();
+    if (workers) {
+        std::unique_lock<std::mutex> lk(gSoftPool.lock);
+        while (gSoftPool.busy) gSoftPool.done.wait(lk);
+    }
+    gSoft.prims.clear();
+    gSoft.layers.clear();
+    for(size_t t = 0; t < gSoft.tiles.size(); t++) gSoft.tiles[t].clear();
+    gSoft.clearPending = false;
+    gSoft.flushes++;
+}
+
+// Set up and bin one batch draw
+void softDraw(const BatchState& st, const BatchVertex* verts, size_t count) {
+    float sx = gRenderW / V_WIDTH, sy = gRenderH / V_HEIGHT;
+    const SoftTexture* tex = st.texture ? &gSoftTextures[st.texture - 1] : NULL;
+    float size = std::max(1.0f, st.size * gPixelScale);
+
+    if (st.prim == BATCH_TRIANGLES) {
+        for(size_t i = 0; i + 2 < count; i += 3) {
+            // Ellipse and glow quads are drawn from their equations
+            if (verts[i].shape >= SHAPE_ELLIPSE && i + 5 < count) {
+                softEllipse(&verts[i], sx, sy, st.blend);
+                i += 3;
+                continue;
+            }
+            softTriangle(softVertex(verts[i], sx, sy),
+                         softVertex(verts[i + 1], sx, sy),
+                         softVertex(verts[i + 2], sx, sy), st.blend, tex);
+        }
+    } else if (st.prim == BATCH_LINES) {
+        // A quad of the line width around each segment
+        for(size_t i = 0; i + 1 < count; i += 2) {
+            SoftVertex p = softVertex(verts[i], sx, sy);
+            SoftVertex q = softVertex(verts[i + 1], sx, sy);
+            float lx = q.x - p.x, ly = q.y - p.y;
+            float len = sqrtf(lx * lx + ly * ly);
+            if (len < 1e-6f) continue;
+            float nx = -ly / len * size * 0.5f, ny = lx / len * size * 0.5f;
+            SoftVertex p0 = p, p1 = p, q0 = q, q1 = q;
+            p0.x += nx; p0.y += ny; p1.x -= nx; p1.y -= ny;
+            q0.x += nx; q0.y += ny; q1.x -= nx; q1.y -= ny;
+            softTriangle(p0, p1, q1, st.blend, tex);
+            softTriangle(p0, q1, q0, st.blend, tex);
+        }
+    } else {
+        // Square points centred on the vertex
+        for(size_t i = 0; i < count; i++) {
+            const BatchVertex& v = verts[i];
+            SoftPrim p;
+            p.kind = SOFT_RECT;
+            p.flat = true;
+            p.blend = st.blend;
+            p.tex = NULL;
+            float x = v.x * sx + gSoft.ox, y = v.y * sy + gSoft.oy;
+            p.x0 = (int)ceilf(x - size * 0.5f - 0.5f);
+            p.x1 = (int)ceilf(x + size * 0.5f - 0.5f);
+            p.y0 = (int)ceilf(y - size * 0.5f - 0.5f);
+            p.y1 = (int)ceilf(y + size * 0.5f - 0.5f);
+            p.c[0] = v.r; p.c[1] = v.g; p.c[2] = v.b; p.c[3] = v.a;
+            softBin(p);
+        }
+    }
+}
+
 // ==================== BASIC SHAPES ====================
 
+// Emit a triangle fan from (cx, cy) to a closed rim as a triangle list,
+// with separate centre and rim colours
+void batchFan(float cx, float cy, const float* rimX, const float* rimY, int segs,
+              float r, float g, float b, float centreA, float rimA) {
+    batchBegin(BATCH_TRIANGLES);
+    for(int i = 0; i < segs; i++) {
+        batchVertex(cx, cy, r, g, b, centreA);
+        batchVertex(rimX[i], rimY[i], r, g, b, rimA);
+        batchVertex(rimX[i + 1], rimY[i + 1], r, g, b, rimA);
+    }
+}
+
+// Emit an ellipse as one quad shaded by its signed distance (shader
+// pipeline and software renderer). The quad is padded by a pixel for
+// the antialiased edge.
+void batchEllipseQuad(float cx, float cy, float rx, float ry,
+                      float r, float g, float b, float centreA, float rimA) {
+    float pu = 1.0f + 1.0f / std::max(rx, 1.0f);
+    float pv = 1.0f + 1.0f / std::max(ry, 1.0f);
+    float x0 = cx - rx * pu, x1 = cx + rx * pu;
+    float y0 = cy - ry * pv, y1 = cy + ry * pv;
+    float shape = SHAPE_ELLIPSE;
+    if (centreA != rimA) {
+        float ratio = centreA > 0.0f ? rimA / centreA : 0.0f;
+        shape = SHAPE_GLOW + std::min(ratio, SHAPE_GLOW_MAX_RATIO);
+    }
+
+    batchBegin(BATCH_TRIANGLES);
+    size_t first = gBatch.verts.size();
+    batchVertexUV(x0, y0, -pu, -pv, r, g, b, centreA);
+    batchVertexUV(x1, y0,  pu, -pv, r, g, b, centreA);
+    batchVertexUV(x1, y1,  pu,  pv, r, g, b, centreA);
+    batchVertexUV(x0, y0, -pu, -pv, r, g, b, centreA);
+    batchVertexUV(x1, y1,  pu,  pv, r, g, b, centreA);
+    batchVertexUV(x0, y1, -pu,  pv, r, g, b, centreA);
+    for(size_t i = first; i < gBatch.verts.size(); i++) {
+        gBatch.verts[i].shape = shape;
+        if (!gBatch.blend) gBatch.verts[i].a = 1.0f;
+    }
+}
+
+// Emit an ellipse fan whose rim comes from the unit circle tables
+void batchEllipseFan(float cx, float cy, float rx, float ry, int segs,
+                     float r, float g, float b, float centreA, float rimA) {
+    if (gCoreProfile || gHeadless) {
+        batchEllipseQuad(cx, cy, rx, ry, r, g, b, centreA, rimA);
+        return;
+    }
+    float rimX[MAX_CIRCLE_SEGS + 1], rimY[MAX_CIRCLE_SEGS + 1];
+    segs = std::min(segs, MAX_CIRCLE_SEGS);
+    circleRing(unitCircle(segs), segs, cx, cy, rx, ry, rimX, rimY);
+    batchFan(cx, cy, rimX, rimY, segs, r, g, b, centreA, rimA);
+}
+
 // Draw a filled rectangle
 void drawRect(float x, float y, float w, float h, float r, float g, float b, float a = 1.0f) {
-    glColor4f(r, g, b, a);
-    glBegin(GL_QUADS);
-        glVertex2f(x, y);
-        glVertex2f(x + w, y);
-        glVertex2f(x + w, y + h);
-        glVertex2f(x, y + h);
-    glEnd();
+    batchBegin(BATCH_TRIANGLES);
+    batchVertex(x,     y,     r, g, b, a);
+    batchVertex(x + w, y,     r, g, b, a);
+    batchVertex(x + w, y + h, r, g, b, a);
+    batchVertex(x,     y,     r, g, b, a);
+    batchVertex(x + w, y + h, r, g, b, a);
+    batchVertex(x,     y + h, r, g, b, a);
 }
 
 // Draw a filled ellipse
 void drawEllipse(float cx, float cy, float rx, float ry, int segs = 48,
                  float r = 1, float g = 1, float b = 1, float a = 1.0f) {
-    glColor4f(r, g, b, a);
-    glBegin(GL_TRIANGLE_FAN);
-        glVertex2f(cx, cy);
-        for(int i = 0; i <= segs; i++) {
-            float t = (float)i / (float)segs * 2.0f * (float)M_PI;
-            glVertex2f(cx + cosf(t) * rx, cy + sinf(t) * ry);
-        }
-    glEnd();
+    batchEllipseFan(cx, cy, rx, ry, segs, r, g, b, a, a);
 }
 
 // Draw a radial glow effect
-void drawRadialGlow(float cx, float cy, float innerR, float outerR, int se,
+void drawRadialGlow(float cx, float cy, float radius,
                     float r, float g, float b) {
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glBegin(GL_TRIANGLE_FAN);
-        glColor4f(r, g, b, 0.35f);
-        glVertex2f(cx, cy);
-        for(int i = 0; i <= se; i++) {
-            float th = 2.0f * M_PI * i / (float)se;
-            glColor4f(r, g, b, 0.04f);
-            glVertex2f(cx + cosf(th) * outerR, cy + sinf(th) * outerR);
-        }
-    glEnd();
-    glDisable(GL_BLEND);
+    drawGlowSprite(GLOW_RADIAL, cx, cy, radius, radius, r, g, b);
+}
+
+// Draw a single line segment in the current colour
+void drawLine(float x1, float y1, float x2, float y2) {
+    batchBegin(BATCH_LINES);
+    batchVertex(x1, y1, gBatch.cr, gBatch.cg, gBatch.cb, gBatch.ca);
+    batchVertex(x2, y2, gBatch.cr, gBatch.cg, gBatch.cb, gBatch.ca);
+}
+
+// Draw a single point in the current colour
+void drawPoint(float x, float y) {
+    batchBegin(BATCH_POINTS);
+    batchVertex(x, y, gBatch.cr, gBatch.cg, gBatch.cb, gBatch.ca);
+}
+
+// Draw a filled triangle
+void drawTriangle(float x1, float y1, float x2, float y2, float x3, float y3,
+                  float r, float g, float b, float a = 1.0f) {
+    batchBegin(BATCH_TRIANGLES);
+    batchVertex(x1, y1, r, g, b, a);
+    batchVertex(x2, y2, r, g, b, a);
+    batchVertex(x3, y3, r, g, b, a);
+}
+
+// Draw a textured rectangle (texcoords 0..1) tinted by the given colour
+void drawTexturedRect(float x, float y, float w, float h, GLuint tex,
+                      BlendMode blend, float r = 1, float g = 1, float b = 1,
+                      float a = 1.0f) {
+    batchBegin(BATCH_TRIANGLES, tex, blend);
+    batchVertexUV(x,     y,     0.0f, 0.0f, r, g, b, a);
+    batchVertexUV(x + w, y,     1.0f, 0.0f, r, g, b, a);
+    batchVertexUV(x + w, y + h, 1.0f, 1.0f, r, g, b, a);
+    batchVertexUV(x,     y,     0.0f, 0.0f, r, g, b, a);
+    batchVertexUV(x + w, y + h, 1.0f, 1.0f, r, g, b, a);
+    batchVertexUV(x,     y + h, 0.0f, 1.0f, r, g, b, a);
 }
 
 // Draw a line using DDA algorithm
@@ -89,13 +2297,11 @@ void drawLineDDA(float x1, float y1, float x2, float y2) {
     float x = x1;
     float y = y1;
 
-    glBegin(GL_POINTS);
-        for(int i = 0; i <= steps; i++) {
-            glVertex2f(x, y);
-            x += xInc;
-            y += yInc;
-        }
-    glEnd();
+    for(int i = 0; i <= steps; i++) {
+        drawPoint(x, y);
+        x += xInc;
+        y += yInc;
+    }
 }
 
 // Draw a line using DDA algorithm (for lamp-specific drawing)
@@ -110,110 +2316,591 @@ void drawLineDDA_Lamp(float x1, float y1, float x2, float y2) {
     float x = x1;
     float y = y1;
 
-    glBegin(GL_POINTS);
-        for(int i = 0; i <= steps; i++) {
-            glVertex2f(x, y);
-            x += xInc;
-            y += yInc;
+    for(int i = 0; i <= steps; i++) {
+        drawPoint(x, y);
+        x += xInc;
+        y += yInc;
+    }
+}
+
+// ==================== MESH LIBRARY ====================
+
+// Filled shapes that never change are triangulated once at startup into
+// indexed meshes (shape-local coordinates, colour per vertex) and drawn
+// by walking their index list through the current transform.
+struct IndexedMesh {
+    std::vector<BatchVertex> verts;
+    std::vector<GLushort> indices;    // triangles, in paint order
+};
+
+enum MeshId {
+    MESH_BOAT_HULL,
+    MESH_BOAT_CABIN,       // stripe, cabin and windows
+    MESH_BAT,
+    MESH_COUNT
+};
+
+IndexedMesh gMeshes[MESH_COUNT];
+
+// Triangulate a simple polygon (x,y pairs, either winding) by ear
+// clipping; appends triangles indexing its points from `base`
+void triangulatePolygon(const float* xy, int n, GLushort base,
+                        std::vector<GLushort>& out) {
+    float area = 0.0f;
+    for(int i = 0; i < n; i++) {
+        int j = (i + 1) % n;
+        area += xy[i * 2] * xy[j * 2 + 1] - xy[j * 2] * xy[i * 2 + 1];
+    }
+    float winding = area < 0.0f ? -1.0f : 1.0f;
+
+    std::vector<int> ring;
+    for(int i = 0; i < n; i++) ring.push_back(i);
+    while (ring.size() > 3) {
+        size_t count = ring.size(), ear = count;
+        for(size_t i = 0; i < count && ear == count; i++) {
+            int a = ring[(i + count - 1) % count], b = ring[i], c = ring[(i + 1) % count];
+            float ax = xy[a * 2], ay = xy[a * 2 + 1];
+            float bx = xy[b * 2], by = xy[b * 2 + 1];
+            float cx = xy[c * 2], cy = xy[c * 2 + 1];
+            float cross = ((bx - ax) * (cy - ay) - (by - ay) * (cx - ax)) * winding;
+            if (cross < 0.0f) continue;           // reflex corner
+            if (cross == 0.0f) { ear = i; break; } // collinear: drop it
+            // An ear may not contain any other remaining point
+            bool blocked = false;
+            for(size_t k = 0; k < count && !blocked; k++) {
+                int p = ring[k];
+                if (p == a || p == b || p == c) continue;
+                float px = xy[p * 2], py = xy[p * 2 + 1];
+                float d0 = ((bx - ax) * (py - ay) - (by - ay) * (px - ax)) * winding;
+                float d1 = ((cx - bx) * (py - by) - (cy - by) * (px - bx)) * winding;
+                float d2 = ((ax - cx) * (py - cy) - (ay - cy) * (px - cx)) * winding;
+                blocked = d0 >= 0.0f && d1 >= 0.0f && d2 >= 0.0f;
+            }
+            if (blocked) continue;
+            out.push_back(base + a);
+            out.push_back(base + b);
+            out.push_back(base + c);
+            ear = i;
+        }
+        if (ear == count) return;   // not a simple polygon
+        ring.erase(ring.begin() + ear);
+    }
+    out.push_back(base + ring[0]);
+    out.push_back(base + ring[1]);
+    out.push_back(base + ring[2]);
+}
+
+// Add a filled polygon to a mesh
+void meshAddPolygon(IndexedMesh& m, const float* xy, int n,
+                    float r, float g, float b, float a = 1.0f) {
+    GLushort base = (GLushort)m.verts.size();
+    for(int i = 0; i < n; i++) {
+        BatchVertex v = { xy[i * 2], xy[i * 2 + 1], 0.0f, 0.0f,
+                          r, g, b, a, SHAPE_FLAT };
+        m.verts.push_back(v);
+    }
+    triangulatePolygon(xy, n, base, m.indices);
+}
+
+// Add a filled rectangle to a mesh
+void meshAddRect(IndexedMesh& m, float x, float y, float w, float h,
+                 float r, float g, float b, float a = 1.0f) {
+    const float xy[] = { x, y,  x + w, y,  x + w, y + h,  x, y + h };
+    meshAddPolygon(m, xy, 4, r, g, b, a);
+}
+
+// Draw a mesh through the current transform
+void drawMesh(MeshId id) {
+    const IndexedMesh& m = gMeshes[id];
+    batchBegin(BATCH_TRIANGLES);
+    for(size_t i = 0; i < m.indices.size(); i++) {
+        const BatchVertex& v = m.verts[m.indices[i]];
+        batchVertex(v.x, v.y, v.r, v.g, v.b, v.a);
+    }
+}
+
+// ==================== PROP INSTANCING ====================
+
+// Props drawn many times with identical geometry
+enum PropType {
+    PROP_WINDOW,
+    PROP_WHEEL,
+    PROP_BAT,
+    PROP_LAMP_POST,
+    PROP_LAMP_GLOW,
+    PROP_SIGNAL_HOUSING,
+    PROP_SIGNAL_LIGHT,
+    PROP_COUNT
+};
+
+// Per-instance attributes: placement and tint
+struct PropInstance {
+    float tx, ty;          // translation
+    float sx, sy;          // scale
+    float r, g, b, a;      // tint multiplied into the mesh colours
+};
+
+// One prop mesh plus the instances queued for it this frame
+struct PropMesh {
+    std::vector<BatchVertex> verts;   // prop-local coordinates
+    std::vector<GLushort> indices;    // empty: verts are plain triangles
+    BatchState state;
+    GLuint vbo, ibo;
+    std::vector<PropInstance> instances;
+};
+
+PropMesh gProps[PROP_COUNT];
+GLuint gPropProgram = 0;
+GLint gPropViewLoc = -1;
+GLint gPropTexturedLoc = -1;
+GLuint gPropInstanceVbo = 0;
+bool gPropInstancing = true;   // false: expand instances into the batch
+
+const char* PROP_VS =
+    "#version 330\n"
+    "layout(location = 0) in vec2 aPos;\n"
+    "layout(location = 1) in vec4 aColor;\n"
+    "layout(location = 2) in vec4 aXform;\n"   // tx, ty, sx, sy
+    "layout(location = 3) in vec4 aTint;\n"
+    "layout(location = 4) in vec2 aUV;\n"
+    "layout(location = 5) in float aShape;\n"
+    "uniform vec2 uView;\n"   // 2 / view size
+    "out vec4 vColor;\n"
+    "out vec2 vUV;\n"
+    "out float vShape;\n"
+    "void main() {\n"
+    "    vec2 p = aXform.xy + aPos * aXform.zw;\n"
+    "    gl_Position = vec4(p * uView - 1.0, 0.0, 1.0);\n"
+    "    vColor = aColor * aTint;\n"
+    "    vUV = aUV;\n"
+    "    vShape = aShape;\n"
+    "}\n";
+
+// Copy a prop mesh to the GPU for instancing
+void uploadProp(PropMesh& m) {
+    if (!gPropProgram) return;
+    glGenBuffers(1, &m.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
+    glBufferData(GL_ARRAY_BUFFER, m.verts.size() * sizeof(BatchVertex),
+                 &m.verts[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (!m.indices.empty()) {
+        glGenBuffers(1, &m.ibo);
+        stateBindVertexArray(gVao);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, m.indices.size() * sizeof(GLushort),
+                     &m.indices[0], GL_STATIC_DRAW);
+    }
+}
+
+// Record a prop's shape function as a mesh. The shape draws around the
+// origin through the batch and must use a single raster state.
+void captureProp(PropType type, void (*shape)()) {
+    batchFlush();
+    BatchTransform savedXf = gBatch.xf;
+    bool savedBlend = gBatch.blend;
+    BatchTransform identity = { 0.0f, 0.0f, 1.0f, 1.0f };
+    gBatch.xf = identity;
+    gBatch.blend = false;
+
+    shape();
+
+    PropMesh& m = gProps[type];
+    m.verts.swap(gBatch.verts);
+    m.state = gBatch.stream;
+    gBatch.verts.clear();
+    gBatch.xf = savedXf;
+    gBatch.blend = savedBlend;
+
+    uploadProp(m);
+}
+
+// Use an indexed library mesh as a prop
+void capturePropMesh(PropType type, MeshId id) {
+    PropMesh& m = gProps[type];
+    m.verts = gMeshes[id].verts;
+    m.indices = gMeshes[id].indices;
+    BatchState st = { BATCH_TRIANGLES, BLEND_ALPHA, 1.0f, 0 };
+    m.state = st;
+    uploadProp(m);
+}
+
+// Queue one instance of a prop through the current transform
+void propInstance(PropType type, float x, float y, float sx = 1.0f, float sy = 1.0f,
+                  float r = 1, float g = 1, float b = 1, float a = 1.0f) {
+    PropInstance in;
+    in.tx = x * gBatch.xf.sx + gBatch.xf.tx;
+    in.ty = y * gBatch.xf.sy + gBatch.xf.ty;
+    in.sx = sx * gBatch.xf.sx;
+    in.sy = sy * gBatch.xf.sy;
+    in.r = r; in.g = g; in.b = b;
+    in.a = gBatch.blend ? a : 1.0f;
+    gProps[type].instances.push_back(in);
+}
+
+// Draw every queued instance of a prop with one draw call
+void flushProps(PropType type) {
+    PropMesh& m = gProps[type];
+    if (m.instances.empty()) return;
+
+    if (gPropInstancing && gPropProgram && !gBatchRecord) {
+        batchBarrier();
+        GLenum mode = applyBatchState(m.state);
+        stateBindVertexArray(gVao);
+        stateUseProgram(gPropProgram);
+        glUniform2f(gPropViewLoc, 2.0f / V_WIDTH, 2.0f / V_HEIGHT);
+        glUniform1i(gPropTexturedLoc, m.state.texture ? 1 : 0);
+        if (m.state.texture) stateBindTexture(m.state.texture);
+
+        glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
+        bindShapeAttribs(0);
+
+        size_t bytes = m.instances.size() * sizeof(PropInstance);
+        size_t offset = ringUpload(&m.instances[0], bytes);
+        if (offset == (size_t)-1) {
+            offset = 0;
+            glBindBuffer(GL_ARRAY_BUFFER, gPropInstanceVbo);
+            glBufferData(GL_ARRAY_BUFFER, bytes, &m.instances[0], GL_STREAM_DRAW);
+        }
+        glEnableVertexAttribArray(2);
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(PropInstance),
+                              (const void*)(offset + offsetof(PropInstance, tx)));
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(PropInstance),
+                              (const void*)(offset + offsetof(PropInstance, r)));
+        glVertexAttribDivisor(2, 1);
+        glVertexAttribDivisor(3, 1);
+
+        if (m.indices.empty()) {
+            glDrawArraysInstanced(mode, 0, (GLsizei)m.verts.size(),
+                                  (GLsizei)m.instances.size());
+        } else {
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.ibo);
+            glDrawElementsInstanced(mode, (GLsizei)m.indices.size(),
+                                    GL_UNSIGNED_SHORT, 0,
+                                    (GLsizei)m.instances.size());
+        }
+
+        glVertexAttribDivisor(2, 0);
+        glVertexAttribDivisor(3, 0);
+        unbindShapeAttribs();
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        gBatch.drawCalls++;
+    } else {
+        // No instancing: expand the instances into the batch stream
+        batchBeginState(m.state);
+        size_t count = m.indices.empty() ? m.verts.size() : m.indices.size();
+        for(size_t i = 0; i < m.instances.size(); i++) {
+            const PropInstance& in = m.instances[i];
+            for(size_t j = 0; j < count; j++) {
+                BatchVertex v = m.verts[m.indices.empty() ? j : m.indices[j]];
+                v.x = in.tx + v.x * in.sx;
+                v.y = in.ty + v.y * in.sy;
+                v.r *= in.r; v.g *= in.g; v.b *= in.b; v.a *= in.a;
+                gBatch.verts.push_back(v);
+            }
+        }
+    }
+    m.instances.clear();
+}
+
+// ==================== SHADER ANIMATION ====================
+
+// How a vertex of an animated mesh moves (aAnim.x); aAnim.yzw are params
+enum AnimKind {
+    ANIM_STATIC,     // never moves
+    ANIM_TRAIN,      // x += trainPos
+    ANIM_BOAT,       // x += boatPos
+    ANIM_STREAK,     // water streak (index, corner x, corner y)
+    ANIM_SHIMMER,    // shimmer bar near the bridge (index)
+    ANIM_SIGNAL      // signal lamp (phase offset, lit from, lit until)
+};
+
+// Meshes whose motion is evaluated in the vertex shader
+enum AnimMeshId {
+    ANIM_MESH_WATER,
+    ANIM_MESH_SIGNALS,
+    ANIM_MESH_TRAIN_BODY,
+    ANIM_MESH_TRAIN_FRONT,
+    ANIM_MESH_BOAT,
+    ANIM_MESH_COUNT
+};
+
+struct AnimVertex {
+    BatchVertex v;
+    float anim[4];
+};
+
+struct AnimMesh {
+    std::vector<AnimVertex> verts;
+    std::vector<MeshRange> ranges;
+    GLuint vbo;
+};
+
+AnimMesh gAnimMeshes[ANIM_MESH_COUNT];
+RecordedMesh gAnimScratch;
+GLuint gAnimProgram = 0;
+GLint gAnimViewLoc = -1, gAnimClockLoc = -1, gAnimWaterLoc = -1;
+GLint gAnimTexturedLoc = -1;
+float gAnimWaterTop = 0.0f;   // water surface the water mesh was built for
+bool gAnimShaders = true;     // false: rebuild animated geometry on the CPU
+
+// Same motion as update()/drawAnimatedWater/drawTrafficSignal, per vertex
+const char* ANIM_VS =
+    "#version 330\n"
+    "layout(location = 0) in vec2 aPos;\n"
+    "layout(location = 1) in vec4 aColor;\n"
+    "layout(location = 4) in vec2 aUV;\n"
+    "layout(location = 5) in float aShape;\n"
+    "layout(location = 6) in vec4 aAnim;\n"
+    "uniform vec2 uView;\n"   // 2 / view size
+    "uniform vec4 uClock;\n"  // waterTime, trafficTimer, trainPos, boatPos
+    "uniform vec2 uWater;\n"  // water top, view width
+    "out vec4 vColor;\n"
+    "out vec2 vUV;\n"
+    "out float vShape;\n"
+    "void main() {\n"
+    "    vec2 p = aPos;\n"
+    "    vec4 c = aColor;\n"
+    "    int kind = int(aAnim.x + 0.5);\n"
+    "    float i = aAnim.y;\n"
+    "    if (kind == 1) {\n"
+    "        p.x += uClock.z;\n"
+    "    } else if (kind == 2) {\n"
+    "        p.x += uClock.w;\n"
+    "    } else if (kind == 3) {\n"
+    "        float t = uClock.x;\n"
+    "        float w = 60.0 + 40.0 * sin(t + i);\n"
+    "        p.x = mod(i * 63.0 + t * 40.0, uWater.y) + aAnim.z * w;\n"
+    "        p.y = mod(i * 14.0 + t * 22.0, uWater.x) + aAnim.w * 2.0;\n"
+    "        c.a = 0.04 + 0.03 * sin(t * 1.4 + i);\n"
+    "    } else if (kind == 4) {\n"
+    "        p.x += sin(uClock.x + i) * 8.0;\n"
+    "    } else if (kind == 5) {\n"
+    "        float t = mod(uClock.y + i, 6.0);\n"
+    "        if (t < aAnim.z || t >= aAnim.w) p = vec2(-100.0);\n"  // unlit: collapse
+    "    }\n"
+    "    gl_Position = vec4(p * uView - 1.0, 0.0, 1.0);\n"
+    "    vColor = c;\n"
+    "    vUV = aUV;\n"
+    "    vShape = aShape;\n"
+    "}\n";
+
+// Start recording batch output for an animated mesh
+void animRecordBegin() {
+    batchFlush();
+    gAnimScratch.verts.clear();
+    gAnimScratch.ranges.clear();
+    gBatchRecord = &gAnimScratch;
+}
+
+// Stop recording and append what was drawn with the given motion.
+// Streak corners are taken from the recorded unit-square positions.
+void animRecordEnd(AnimMesh& m, AnimKind kind, float p0 = 0.0f,
+                   float p1 = 0.0f, float p2 = 0.0f) {
+    batchFlush();
+    gBatchRecord = NULL;
+    for(size_t r = 0; r < gAnimScratch.ranges.size(); r++) {
+        MeshRange range = gAnimScratch.ranges[r];
+        int first = range.first;
+        range.first = (int)m.verts.size();
+        if (!m.ranges.empty() && sameBatchState(m.ranges.back().state, range.state))
+            m.ranges.back().count += range.count;
+        else m.ranges.push_back(range);
+
+        for(int i = first; i < first + range.count; i++) {
+            AnimVertex av;
+            av.v = gAnimScratch.verts[i];
+            av.anim[0] = (float)kind;
+            av.anim[1] = p0;
+            av.anim[2] = (kind == ANIM_STREAK) ? av.v.x : p1;
+            av.anim[3] = (kind == ANIM_STREAK) ? av.v.y : p2;
+            m.verts.push_back(av);
         }
-    glEnd();
+    }
+}
+
+// Upload a finished animated mesh into its static buffer
+void animUpload(AnimMesh& m) {
+    if (m.verts.empty()) return;
+    glGenBuffers(1, &m.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
+    glBufferData(GL_ARRAY_BUFFER, m.verts.size() * sizeof(AnimVertex),
+                 &m.verts[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Draw an animated mesh at the current clocks. Returns false when the
+// caller has to build the geometry on the CPU instead.
+bool drawAnimMesh(AnimMeshId id) {
+    AnimMesh& m = gAnimMeshes[id];
+    if (!gAnimShaders || !gAnimProgram || !m.vbo || gBatchRecord) return false;
+
+    batchBarrier();
+    stateBindVertexArray(gVao);
+    stateUseProgram(gAnimProgram);
+    glUniform2f(gAnimViewLoc, 2.0f / V_WIDTH, 2.0f / V_HEIGHT);
+    glUniform4f(gAnimClockLoc, waterTime, trafficTimer, trainPos, boatPos);
+    glUniform2f(gAnimWaterLoc, gAnimWaterTop, V_WIDTH);
+
+    glBindBuffer(GL_ARRAY_BUFFER, m.vbo);
+    bindShapeAttribs(0, sizeof(AnimVertex));
+    glEnableVertexAttribArray(6);
+    glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(AnimVertex),
+                          (const void*)offsetof(AnimVertex, anim));
+    for(size_t r = 0; r < m.ranges.size(); r++) {
+        const BatchState& st = m.ranges[r].state;
+        GLenum mode = applyBatchState(st);
+        glUniform1i(gAnimTexturedLoc, st.texture ? 1 : 0);
+        if (st.texture) stateBindTexture(st.texture);
+        glDrawArrays(mode, m.ranges[r].first, m.ranges[r].count);
+        gBatch.drawCalls++;
+    }
+    glDisableVertexAttribArray(6);
+    unbindShapeAttribs();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return true;
 }
 
 // ==================== SINGLE LAMP POST (TALLER + DEEPER LIGHT) ====================
 
-// Draw a DDA-based lamp post with taller pole and deeper, warmer light glow
-void drawDDALampPost(float x, float groundY) {
-    glPointSize(2.0f);
+// Height configuration
+const float LAMP_POLE_HEIGHT = 170.0f;   // was 120.0f -> now taller
+const float LAMP_ARM_LENGTH  = 22.0f;
+const float LAMP_HEAD_LENGTH = 12.0f;    // lamp head length ~12px
+const float LAMP_GLOW_DROP   = 22.0f;    // glow center a bit below the head
 
-    // Height configuration
-    float poleHeight   = 170.0f;          // was 120.0f -> now taller
-    float armY         = groundY + poleHeight;
-    float headBottomY  = armY - 12.0f;    // lamp head length ~12px
-    float glowCenterY  = armY - 22.0f;    // glow center a bit below the head
+// Pole, arm and head of a DDA lamp post (foot of the pole at the origin)
+void drawLampPostShape() {
+    setPointSize(2.0f);
+
+    float armY        = LAMP_POLE_HEIGHT;
+    float headBottomY = armY - LAMP_HEAD_LENGTH;
 
     // Pole
-    glColor3f(0.35f, 0.35f, 0.38f);
-    drawLineDDA_Lamp(x, groundY, x, armY);
+    setColor(0.35f, 0.35f, 0.38f);
+    drawLineDDA_Lamp(0.0f, 0.0f, 0.0f, armY);
 
     // Horizontal arm
-    drawLineDDA_Lamp(x, armY,
-                     x + 22.0f, armY);
+    drawLineDDA_Lamp(0.0f, armY,
+                     LAMP_ARM_LENGTH, armY);
 
     // Lamp head
-    glColor3f(1.0f, 0.95f, 0.65f);
-    drawLineDDA_Lamp(x + 22.0f, armY,
-                     x + 22.0f, headBottomY);
-
-    // Deeper, layered glow (repositioned according to new height)
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    setColor(1.0f, 0.95f, 0.65f);
+    drawLineDDA_Lamp(LAMP_ARM_LENGTH, armY,
+                     LAMP_ARM_LENGTH, headBottomY);
+}
 
-    float lx = x + 22.0f;  // lamp center X
-    float ly = glowCenterY; // lamp center Y (higher than before)
+// Deeper, layered glow around the lamp center (at the origin):
+// core, mid and outer halos plus a wide radial glow (GLOW_LAMP_LAYERS)
+void drawLampGlowShape() {
+    setBlend(true);
+    drawGlowSprite(GLOW_LAMP, 0.0f, 0.0f, 1.0f, 1.0f);
+}
 
-    // Core bright area (small, very intense)
-    drawEllipse(lx, ly,
-                7.5f, 6.0f, 32,
-                1.0f, 0.99f, 0.88f, 1.0f);
+// Queue a DDA-based lamp post with taller pole and deeper, warmer light
+// glow; drawn by flushProps(PROP_LAMP_POST / PROP_LAMP_GLOW)
+void drawDDALampPost(float x, float groundY) {
+    float lx = x + LAMP_ARM_LENGTH;                        // lamp center X
+    float ly = groundY + LAMP_POLE_HEIGHT - LAMP_GLOW_DROP; // lamp center Y
 
-    // Mid halo (main visible glow)
-    drawEllipse(lx, ly,
-                16.0f, 12.0f, 32,
-                1.0f, 0.93f, 0.72f, 0.55f);
+    propInstance(PROP_LAMP_POST, x, groundY);
+    propInstance(PROP_LAMP_GLOW, lx, ly);
+}
 
-    // Outer soft halo
-    drawEllipse(lx, ly,
-                30.0f, 20.0f, 32,
-                1.0f, 0.86f, 0.55f, 0.26f);
+// ==================== SKY, HALFTONE, CLOUDS ====================
 
-    // Wide subtle radial glow
-    drawRadialGlow(lx, ly, 10.0f, 60.0f, 32,
-                   1.0f, 0.85f, 0.50f);
+// Vertical gradients are N-stop lookup tables kept in Nx1 textures and
+// drawn as one textured quad. Changing the stops only rebuilds the table.
+const int MAX_GRADIENT_STOPS = 16;
+const int GRADIENT_TEXELS = 256;
+
+// Colour stop; pos 0 is the bottom of the rectangle, 1 the top
+struct GradientStop {
+    float pos;
+    float r, g, b;
+};
+
+struct Gradient {
+    GradientStop stops[MAX_GRADIENT_STOPS];   // sorted by pos
+    int count;
+    GLuint tex;
+    bool dirty;            // table needs regenerating
+};
+
+// Teal top -> purple mid -> warm horizon
+Gradient gSkyGradient = {
+    {
+        { 0.0f, 1.0f, 0.62f, 0.34f },    // bottom: warm orange
+        { 0.5f, 0.28f, 0.12f, 0.36f },   // mid: violet
+        { 1.0f, 0.02f, 0.12f, 0.18f }    // top: deep teal-blue
+    },
+    3, 0, true
+};
+
+// Replace a gradient's stops; the table is rebuilt on next use
+void setGradientStops(Gradient& grad, const GradientStop* stops, int n) {
+    grad.count = std::min(n, MAX_GRADIENT_STOPS);
+    for(int i = 0; i < grad.count; i++) grad.stops[i] = stops[i];
+    grad.dirty = true;
+}
 
-    glDisable(GL_BLEND);
+// Interpolated colour at t (0 bottom .. 1 top)
+void gradientColor(const Gradient& grad, float t, float rgb[3]) {
+    const GradientStop* s = grad.stops;
+    int i = 0;
+    while (i + 1 < grad.count && t > s[i + 1].pos) i++;
+    if (i + 1 >= grad.count || t <= s[i].pos) {
+        rgb[0] = s[i].r; rgb[1] = s[i].g; rgb[2] = s[i].b;
+        return;
+    }
+    float f = (t - s[i].pos) / std::max(s[i + 1].pos - s[i].pos, 1e-6f);
+    rgb[0] = s[i].r + (s[i + 1].r - s[i].r) * f;
+    rgb[1] = s[i].g + (s[i + 1].g - s[i].g) * f;
+    rgb[2] = s[i].b + (s[i + 1].b - s[i].b) * f;
 }
 
-// ==================== SKY, HALFTONE, CLOUDS ====================
+// Regenerate the lookup texture from the stops
+void uploadGradient(Gradient& grad) {
+    unsigned char texels[GRADIENT_TEXELS * 4];
+    for(int i = 0; i < GRADIENT_TEXELS; i++) {
+        float rgb[3];
+        gradientColor(grad, i / (float)(GRADIENT_TEXELS - 1), rgb);
+        for(int k = 0; k < 3; k++)
+            texels[i * 4 + k] = (unsigned char)(rgb[k] * 255.0f + 0.5f);
+        texels[i * 4 + 3] = 255;
+    }
+    if (!grad.tex) {
+        grad.tex = createTexture(GRADIENT_TEXELS, 1, true, texels);
+    } else {
+        batchBarrier();    // queued draws may still sample the old table
+        updateTexture(grad.tex, 0, 0, GRADIENT_TEXELS, 1, texels);
+    }
+    grad.dirty = false;
+}
 
-// FIXED: Draw vertical gradient with proper two-quad method
-void drawVerticalGradient(float x, float y, float w, float h,
-                          float rTop, float gTop, float bTop,
-                          float rMid, float gMid, float bMid,
-                          float rBot, float gBot, float bBot) {
-    // Split into two quads to avoid triangular artifacts
-    float midY = y + h * 0.50f;
-
-    // Top quad (top color -> mid color)
-    glBegin(GL_QUADS);
-        glColor3f(rTop, gTop, bTop); glVertex2f(x,      y + h);  // top-left
-        glColor3f(rTop, gTop, bTop); glVertex2f(x + w,  y + h);  // top-right
-        glColor3f(rMid, gMid, bMid); glVertex2f(x + w,  midY);   // mid-right
-        glColor3f(rMid, gMid, bMid); glVertex2f(x,      midY);   // mid-left
-    glEnd();
-
-    // Bottom quad (mid color -> bottom color)
-    glBegin(GL_QUADS);
-        glColor3f(rMid, gMid, bMid); glVertex2f(x,      midY);   // mid-left
-        glColor3f(rMid, gMid, bMid); glVertex2f(x + w,  midY);   // mid-right
-        glColor3f(rBot, gBot, bBot); glVertex2f(x + w,  y);      // bot-right
-        glColor3f(rBot, gBot, bBot); glVertex2f(x,      y);      // bot-left
-    glEnd();
+// Fill a rectangle with a vertical gradient (one textured quad)
+void drawGradientRect(Gradient& grad, float x, float y, float w, float h) {
+    if (grad.dirty) uploadGradient(grad);
+    // Texel centres, so the ends hit the first and last stop exactly
+    float u0 = 0.5f / GRADIENT_TEXELS, u1 = 1.0f - u0;
+    batchBegin(BATCH_TRIANGLES, grad.tex, BLEND_ALPHA);
+    batchVertexUV(x,     y,     u0, 0.5f, 1.0f, 1.0f, 1.0f, 1.0f);
+    batchVertexUV(x + w, y,     u0, 0.5f, 1.0f, 1.0f, 1.0f, 1.0f);
+    batchVertexUV(x + w, y + h, u1, 0.5f, 1.0f, 1.0f, 1.0f, 1.0f);
+    batchVertexUV(x,     y,     u0, 0.5f, 1.0f, 1.0f, 1.0f, 1.0f);
+    batchVertexUV(x + w, y + h, u1, 0.5f, 1.0f, 1.0f, 1.0f, 1.0f);
+    batchVertexUV(x,     y + h, u1, 0.5f, 1.0f, 1.0f, 1.0f, 1.0f);
 }
 
 // Draw the sky gradient background
 void drawSky() {
-    glShadeModel(GL_SMOOTH);
-    // Teal top -> purple mid -> warm horizon
-    drawVerticalGradient(0, 0, V_WIDTH, V_HEIGHT,
-                         0.02f, 0.12f, 0.18f,    // top: deep teal-blue
-                         0.28f, 0.12f, 0.36f,    // mid: violet
-                         1.0f, 0.62f, 0.34f);    // bottom: warm orange
+    drawGradientRect(gSkyGradient, 0, 0, V_WIDTH, V_HEIGHT);
     // Subtle darker vignette near top corners (push eye to center)
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    setBlend(true);
     drawRect(0, V_HEIGHT * 0.82f, V_WIDTH, V_HEIGHT * 0.18f,
              0.0f, 0.0f, 0.06f, 0.12f);
-    glDisable(GL_BLEND);
+    setBlend(false);
 }
 
 // Draw a halftone band effect
@@ -221,8 +2908,7 @@ void drawHalftoneBand() {
     float bandY = V_HEIGHT * 0.38f;
     int rows = 6;
     int cols = 120;
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    setBlend(true);
     for(int r = 0; r < rows; r++) {
         for(int c = 0; c < cols; c++) {
             if ((c + r) % 2 != 0) continue;
@@ -231,13 +2917,12 @@ void drawHalftoneBand() {
             drawRect(x, y, 2.8f, 2.8f, 0.95f, 0.9f, 0.7f, 0.35f);
         }
     }
-    glDisable(GL_BLEND);
+    setBlend(false);
 }
 
 // Draw a cloud with multiple layers
 void drawCloud(float cx, float cy, float scale = 1.0f, float alpha = 0.6f) {
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    setBlend(true);
     float tintR = 0.92f, tintG = 0.88f, tintB = 0.95f;
     drawEllipse(cx, cy, 120.0f * scale, 34.0f * scale, 48,
                 tintR, tintG, tintB, 0.18f * alpha);
@@ -259,15 +2944,14 @@ void drawCloud(float cx, float cy, float scale = 1.0f, float alpha = 0.6f) {
     drawRect(cx - 160.0f * scale, cy - 28.0f * scale,
              320.0f * scale, 6.0f * scale,
              0.02f, 0.02f, 0.04f, 0.03f * alpha);
-    glDisable(GL_BLEND);
+    setBlend(false);
 }
 
 // Draw a layer of procedural clouds
 void drawCloudLayer(float baseY, int seed, int count, float alpha,
                     float scaleMin = 0.7f, float scaleMax = 1.2f) {
     srand(seed);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    setBlend(true);
     for(int i = 0; i < count; i++) {
         float cx = frandf() * V_WIDTH;
         float rx = 40.0f + frandf() * 160.0f;
@@ -280,49 +2964,245 @@ void drawCloudLayer(float baseY, int seed, int count, float alpha,
                     ry, 36,
                     tint * 0.92f, tint * 0.83f, tint * 1.02f, a);
     }
-    glDisable(GL_BLEND);
+    setBlend(false);
+}
+
+// ==================== BUILDINGS & BRIDGE ====================
+
+// Unit window quad, scaled and tinted per instance
+void drawWindowShape() {
+    drawRect(0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f);
+}
+
+// Skyline buildings are generated once per parameter set. Each one is
+// baked into its own region of an impostor atlas at one texel per scene
+// unit; window and facade edges all sit on whole units from the corner,
+// so a nearest-filtered quad matches the per-window rects at any render
+// size. With gWindowSwitching on, windows switch on and off over time,
+// and a switch only rewrites that window's texels. Buildings that do not
+// fit in the atlas, or all of them with impostors off, draw one rect per
+// lit window instead.
+const int IMPOSTOR_ATLAS_W = 1024;
+const int IMPOSTOR_ATLAS_H = 1024;
+const int WINDOW_SWITCH_FRAMES = 20;   // update() ticks between switches
+bool gWindowSwitching = false;         // 'w' or --window-switching
+const float WINDOW_W = 12.0f, WINDOW_H = 10.0f;
+
+struct BuildingWindow {
+    float x, y;            // from the building's corner, whole units
+    float r, g, b, a;      // colour when lit
+    bool on;
+};
+
+struct Building {
+    float x, y, w, h;
+    float r, g, b;         // facade
+    int atlasX, atlasY;    // impostor region, -1 if not in the atlas
+    std::vector<BuildingWindow> windows;
+};
+
+struct Skyline {
+    float params[7];       // baseY, minW, maxW, minH, maxH, seed, darkness
+    std::vector<Building> buildings;
+};
+
+struct ImpostorAtlas {
+    bool enabled;
+    GLuint tex;
+    int shelfX, shelfY, shelfH;   // shelf packer cursor
+    int buildings;                // regions handed out
+    int uploads, texels;          // window updates and texels sent
+    unsigned version;             // bumped by every window switch
+    std::vector<float> damage;    // switched windows, x0 y0 x1 y1 in scene units
+};
+
+std::vector<Skyline> gSkylines;
+ImpostorAtlas gImpostors = { true, 0, 0, 0, 0, 0, 0, 0, 0, {} };
+
+// Texel of a lit window or of the bare facade. The skyline is drawn
+// with blending off, so a window simply replaces the facade.
+void impostorTexel(const Building& b, const BuildingWindow* win,
+                   unsigned char out[4]) {
+    bool lit = win && win->on;
+    out[0] = packUnorm(lit ? win->r : b.r);
+    out[1] = packUnorm(lit ? win->g : b.g);
+    out[2] = packUnorm(lit ? win->b : b.b);
+    out[3] = 255;
+}
+
+// Find a region for the building and upload its facade and windows
+void bakeImpostor(Building& b) {
+    b.atlasX = b.atlasY = -1;
+    int w = (int)ceilf(b.w), h = (int)ceilf(b.h);
+    ImpostorAtlas& A = gImpostors;
+    if (A.shelfX + w > IMPOSTOR_ATLAS_W) {
+        A.shelfX = 0;
+        A.shelfY += A.shelfH;
+        A.shelfH = 0;
+    }
+    if (w > IMPOSTOR_ATLAS_W || A.shelfY + h > IMPOSTOR_ATLAS_H) return;
+    if (!A.tex)
+        A.tex = createTexture(IMPOSTOR_ATLAS_W, IMPOSTOR_ATLAS_H, false, NULL);
+    b.atlasX = A.shelfX;
+    b.atlasY = A.shelfY;
+    A.shelfX += w;
+    A.shelfH = std::max(A.shelfH, h);
+    A.buildings++;
+
+    std::vector<unsigned char> texels(w * h * 4);
+    unsigned char facade[4];
+    impostorTexel(b, NULL, facade);
+    for(int i = 0; i < w * h; i++) memcpy(&texels[i * 4], facade, 4);
+    for(size_t i = 0; i < b.windows.size(); i++) {
+        const BuildingWindow& win = b.windows[i];
+        unsigned char c[4];
+        impostorTexel(b, &win, c);
+        for(int y = (int)win.y; y < (int)(win.y + WINDOW_H); y++)
+            for(int x = (int)win.x; x < (int)(win.x + WINDOW_W); x++)
+                memcpy(&texels[(y * w + x) * 4], c, 4);
+    }
+    updateTexture(A.tex, b.atlasX, b.atlasY, w, h, &texels[0]);
+}
+
+// Rewrite one window's texels after it switched
+void updateImpostorWindow(const Building& b, const BuildingWindow& win) {
+    if (b.atlasX < 0) return;
+    unsigned char c[4];
+    impostorTexel(b, &win, c);
+    int n = (int)(WINDOW_W * WINDOW_H);
+    std::vector<unsigned char> texels(n * 4);
+    for(int i = 0; i < n; i++) memcpy(&texels[i * 4], c, 4);
+    batchBarrier();    // queued draws may still sample the old texels
+    updateTexture(gImpostors.tex, b.atlasX + (int)win.x, b.atlasY + (int)win.y,
+                  (int)WINDOW_W, (int)WINDOW_H, &texels[0]);
+    gImpostors.uploads++;
+    gImpostors.texels += n;
+}
+
+// Generate a skyline's buildings; the random sequence is the one the
+// per-building draw code always used, so the city looks the same
+void buildSkyline(Skyline& s) {
+    float baseY = s.params[0], minW = s.params[1], maxW = s.params[2];
+    float minH = s.params[3], maxH = s.params[4], darkness = s.params[6];
+    int seed = (int)s.params[5];
+    const float marginX = 6.0f, marginY = 10.0f;
+    const float spx = 6.0f, spy = 8.0f;
+    srand(seed);
+    float x = -20.0f;
+    int i = 0;
+    while (x < V_WIDTH + 40.0f) {
+        Building b;
+        b.x = x;
+        b.y = baseY;
+        b.w = minW + frandf() * (maxW - minW);
+        b.h = minH + frandf() * (maxH - minH);
+        float d = darkness - frandf() * 0.12f;
+        b.r = d * 0.15f;
+        b.g = d * 0.18f;
+        b.b = d * 0.22f;
+        srand(seed + i * 31);
+        int cols = (int)((b.w - 2 * marginX) / (WINDOW_W + spx));
+        int rows = (int)((b.h - 2 * marginY) / (WINDOW_H + spy));
+        for(int r = 0; r < rows; r++) {
+            for(int c = 0; c < cols; c++) {
+                // One window in four starts dark, lit at mid brightness
+                bool on = (rand() % 4) != 0;
+                float warm = 0.95f - (float)r / (float)rows * 0.45f;
+                float bright = on ? 0.4f + frandf() * 0.85f : 0.8f;
+                BuildingWindow win = { marginX + c * (WINDOW_W + spx),
+                                       marginY + r * (WINDOW_H + spy),
+                                       warm, warm * 0.8f, 0.45f,
+                                       0.85f * bright, on };
+                b.windows.push_back(win);
+            }
+        }
+        bakeImpostor(b);
+        s.buildings.push_back(b);
+        x += b.w + 6.0f + frandf() * 12.0f;
+        ++i;
+    }
+}
+
+// The skyline for a parameter set, generated on first use
+Skyline& skylineFor(const float params[7]) {
+    for(size_t i = 0; i < gSkylines.size(); i++)
+        if (memcmp(gSkylines[i].params, params, sizeof(float) * 7) == 0)
+            return gSkylines[i];
+    Skyline s;
+    memcpy(s.params, params, sizeof(float) * 7);
+    gSkylines.push_back(s);
+    buildSkyline(gSkylines.back());
+    return gSkylines.back();
 }
 
-// ==================== BUILDINGS & BRIDGE ====================
+// Switch the next window in a fixed, scattered order, so runs repeat
+void switchWindowLight() {
+    static unsigned n = 0;
+    if (gSkylines.empty()) return;
+    n++;
+    Skyline& s = gSkylines[n % gSkylines.size()];
+    Building& b = s.buildings[(n * 7u) % s.buildings.size()];
+    if (b.windows.empty()) return;
+    BuildingWindow& win = b.windows[(n * 13u) % b.windows.size()];
+    win.on = !win.on;
+    updateImpostorWindow(b, win);
+    float rect[4] = { b.x + win.x, b.y + win.y,
+                      b.x + win.x + WINDOW_W, b.y + win.y + WINDOW_H };
+    gImpostors.damage.insert(gImpostors.damage.end(), rect, rect + 4);
+    gImpostors.version++;
+}
 
-// Draw a blocky building with windows
-void drawBuildingBlocky(float x, float y, float w, float h,
-                        float darkness, int seed) {
-    srand(seed);
-    drawRect(x, y, w, h,
-             darkness * 0.15f, darkness * 0.18f, darkness * 0.22f, 1.0f);
-    float marginX = 6.0f, marginY = 10.0f;
-    float cw = 12.0f, ch = 10.0f;
-    float spx = 6.0f, spy = 8.0f;
-    int cols = (int)((w - 2 * marginX) / (cw + spx));
-    int rows = (int)((h - 2 * marginY) / (ch + spy));
-    for(int r = 0; r < rows; r++) {
-        for(int c = 0; c < cols; c++) {
-            if ((rand() % 4) == 0) continue;
-            float wx = x + marginX + c * (cw + spx);
-            float wy = y + marginY + r * (ch + spy);
-            float warm = 0.95f - (float)r / (float)rows * 0.45f;
-            float bright = 0.4f + frandf() * 0.85f;
-            drawRect(wx, wy, cw, ch,
-                     warm * 1.0f, warm * 0.8f, 0.45f, 0.85f * bright);
-        }
+// Draw a blocky building; its windows are queued as PROP_WINDOW instances
+void drawBuildingBlocky(const Building& b) {
+    drawRect(b.x, b.y, b.w, b.h, b.r, b.g, b.b, 1.0f);
+    for(size_t i = 0; i < b.windows.size(); i++) {
+        const BuildingWindow& win = b.windows[i];
+        if (!win.on) continue;
+        propInstance(PROP_WINDOW, b.x + win.x, b.y + win.y, WINDOW_W, WINDOW_H,
+                     win.r, win.g, win.b, win.a);
     }
 }
 
+// Queue a textured quad
+void batchTexQuad(float x0, float y0, float x1, float y1,
+                  float u0, float v0, float u1, float v1) {
+    batchVertexUV(x0, y0, u0, v0, 1.0f, 1.0f, 1.0f, 1.0f);
+    batchVertexUV(x1, y0, u1, v0, 1.0f, 1.0f, 1.0f, 1.0f);
+    batchVertexUV(x1, y1, u1, v1, 1.0f, 1.0f, 1.0f, 1.0f);
+    batchVertexUV(x0, y0, u0, v0, 1.0f, 1.0f, 1.0f, 1.0f);
+    batchVertexUV(x1, y1, u1, v1, 1.0f, 1.0f, 1.0f, 1.0f);
+    batchVertexUV(x0, y1, u0, v1, 1.0f, 1.0f, 1.0f, 1.0f);
+}
+
+// Draw a building as its impostor. Texture coordinates are only exact
+// at whole texels, so the whole-unit part of the building is one quad
+// and the fractional strips along the right and top edge repeat the
+// plain facade texel at its corner.
+void drawBuildingImpostor(const Building& b) {
+    const float sx = 1.0f / IMPOSTOR_ATLAS_W, sy = 1.0f / IMPOSTOR_ATLAS_H;
+    float w = floorf(b.w), h = floorf(b.h);
+    float u0 = b.atlasX * sx, v0 = b.atlasY * sy;
+    float fu = (b.atlasX + 0.5f) * sx, fv = (b.atlasY + 0.5f) * sy;
+    batchTexQuad(b.x, b.y, b.x + w, b.y + h, u0, v0, u0 + w * sx, v0 + h * sy);
+    if (b.w > w)
+        batchTexQuad(b.x + w, b.y, b.x + b.w, b.y + b.h, fu, fv, fu, fv);
+    if (b.h > h)
+        batchTexQuad(b.x, b.y + h, b.x + w, b.y + b.h, fu, fv, fu, fv);
+}
+
 // Draw a layer of skyline buildings
-void drawSkylineLayer(float baseY, float minW, float maxW,
-                      float minH, float maxH, int seed, float darkness) {
-    srand(seed);
-    float x = -20.0f;
-    int i = 0;
-    while (x < V_WIDTH + 40.0f) {
-        float w = minW + frandf() * (maxW - minW);
-        float h = minH + frandf() * (maxH - minH);
-        float d = darkness - frandf() * 0.12f;
-        drawBuildingBlocky(x, baseY, w, h, d, seed + i * 31);
-        x += w + 6.0f + frandf() * 12.0f;
-        ++i;
+void drawSkylineLayer(const float params[7]) {
+    const Skyline& s = skylineFor(params);
+    for(size_t i = 0; i < s.buildings.size(); i++) {
+        const Building& b = s.buildings[i];
+        if (b.atlasX >= 0 && gImpostors.enabled) {
+            batchBegin(BATCH_TRIANGLES, gImpostors.tex, BLEND_ALPHA);
+            drawBuildingImpostor(b);
+        } else {
+            drawBuildingBlocky(b);
+        }
     }
+    flushProps(PROP_WINDOW);
 }
 
 // Draw the bridge and water
@@ -335,22 +3215,21 @@ void drawBridgeAndWater() {
     drawRect(0, bridgeY + 72.0f, V_WIDTH, 6.0f,
              0.03f, 0.03f, 0.05f, 1.0f);
 
-    glLineWidth(2.0f);
-    glColor3f(0.14f, 0.14f, 0.16f);
-    glBegin(GL_LINES);
-        glVertex2f(18.0f, bridgeY + 16.0f);
-        glVertex2f(V_WIDTH - 18.0f, bridgeY + 16.0f);
-        glVertex2f(18.0f, bridgeY + 30.0f);
-        glVertex2f(V_WIDTH - 18.0f, bridgeY + 30.0f);
-    glEnd();
+    setLineWidth(2.0f);
+    setColor(0.14f, 0.14f, 0.16f);
+    drawLine(18.0f, bridgeY + 16.0f, V_WIDTH - 18.0f, bridgeY + 16.0f);
+    drawLine(18.0f, bridgeY + 30.0f, V_WIDTH - 18.0f, bridgeY + 30.0f);
 
     for(float px = 36.0f; px < V_WIDTH; px += 40.0f) {
         drawRect(px - 2.0f, bridgeY, 4.0f, 72.0f,
                  0.07f, 0.07f, 0.09f);
     }
+}
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+// Draw the flickering reflections of the bridge lights on the river
+void drawBridgeReflections() {
+    float bridgeY = 120.0f;
+    setBlend(true);
     for(int i = 0; i < 18; i++) {
         float rx = frandf() * V_WIDTH;
         float rw = 30.0f + frandf() * 100.0f;
@@ -359,7 +3238,7 @@ void drawBridgeAndWater() {
         drawRect(rx, ry, rw, 1.0f + frandf() * 3.0f,
                  0.95f, 0.7f, 0.4f, a);
     }
-    glDisable(GL_BLEND);
+    setBlend(false);
 }
 
 // ==================== POWER PILLARS + WIRES ====================
@@ -393,23 +3272,24 @@ void drawPowerPillar(float x, float baseY, float height, int seed) {
 
 // Draw power wires between towers
 void drawPowerWires(const std::vector<float>& towerXs, float baseY, float height) {
-    glLineWidth(2.0f);
-    glColor3f(0.06f, 0.06f, 0.08f);
+    setLineWidth(2.0f);
+    setColor(0.06f, 0.06f, 0.08f);
 
     for (int strand = 0; strand < 3; ++strand) {
-        glBegin(GL_LINE_STRIP);
-            for (size_t i = 0; i < towerXs.size(); ++i) {
-                float x = towerXs[i];
-                float topY = baseY + 72.0f + height - (strand * 12.0f);
-                float sag = 12.0f * sinf((float)i * 0.6f + strand * 0.9f) * 0.08f;
-                glVertex2f(x, topY - fabs(sag));
-                if (i + 1 < towerXs.size()) {
-                    float nx = (towerXs[i] + towerXs[i+1]) * 0.5f;
-                    float midY = topY + 10.0f + (sag * 0.6f);
-                    glVertex2f(nx, midY);
-                }
+        float px = 0.0f, py = 0.0f;
+        for (size_t i = 0; i < towerXs.size(); ++i) {
+            float x = towerXs[i];
+            float topY = baseY + 72.0f + height - (strand * 12.0f);
+            float sag = 12.0f * sinf((float)i * 0.6f + strand * 0.9f) * 0.08f;
+            if (i > 0) drawLine(px, py, x, topY - fabs(sag));
+            px = x; py = topY - fabs(sag);
+            if (i + 1 < towerXs.size()) {
+                float nx = (towerXs[i] + towerXs[i+1]) * 0.5f;
+                float midY = topY + 10.0f + (sag * 0.6f);
+                drawLine(px, py, nx, midY);
+                px = nx; py = midY;
             }
-        glEnd();
+        }
     }
 }
 
@@ -427,467 +3307,1646 @@ void drawPowerPillarsAndWires() {
 
 // ==================== TRAFFIC SIGNAL ====================
 
-// Draw an animated traffic signal
-void drawTrafficSignal(float x, float bridgeY, float phaseOffsetSec) {
-    float boxW = 18.0f;
-    float boxH = 54.0f;
-    float boxX = x - boxW * 0.5f;
-    float boxY = bridgeY + 72.0f + 60.0f;
-    drawRect(x - 4.0f, bridgeY + 72.0f, 8.0f, 56.0f,
+// Signal box geometry relative to the pole foot on the bridge deck
+const float SIGNAL_BOX_W = 18.0f;
+const float SIGNAL_BOX_H = 54.0f;
+const float SIGNAL_BOX_Y = 72.0f + 60.0f;
+
+// Lamp centres inside the box
+const float SIGNAL_RED_Y    = SIGNAL_BOX_Y + SIGNAL_BOX_H - 10.0f;
+const float SIGNAL_YELLOW_Y = SIGNAL_BOX_Y + SIGNAL_BOX_H * 0.5f;
+const float SIGNAL_GREEN_Y  = SIGNAL_BOX_Y + 10.0f;
+
+// Pole, housing and the three dimmed lamps of a traffic signal
+void drawSignalHousingShape() {
+    float boxW = SIGNAL_BOX_W;
+    float boxH = SIGNAL_BOX_H;
+    float boxX = -boxW * 0.5f;
+    float boxY = SIGNAL_BOX_Y;
+    drawRect(-4.0f, 72.0f, 8.0f, 56.0f,
              0.12f, 0.12f, 0.14f);
     drawRect(boxX - 2.0f, boxY - 6.0f, boxW + 4.0f, boxH + 6.0f,
              0.06f, 0.06f, 0.07f, 1.0f);
     drawRect(boxX, boxY, boxW, boxH,
              0.08f, 0.08f, 0.09f, 1.0f);
 
-    float t = fmodf(trafficTimer + phaseOffsetSec, 6.0f);
-    bool redOn = (t < 2.5f);
-    bool greenOn = (t >= 2.5f && t < 5.0f);
-    bool yellowOn = (t >= 5.0f);
-    float cx = x;
-    float cy_red = boxY + boxH - 10.0f;
-    float cy_yel = boxY + boxH * 0.5f;
-    float cy_grn = boxY + 10.0f;
     float dim = 0.15f;
-    drawEllipse(cx, cy_red, 6.8f, 6.8f, 24,
+    drawEllipse(0.0f, SIGNAL_RED_Y, 6.8f, 6.8f, 24,
                 dim, 0.0f, 0.0f, 1.0f);
-    drawEllipse(cx, cy_yel, 6.8f, 6.8f, 24,
+    drawEllipse(0.0f, SIGNAL_YELLOW_Y, 6.8f, 6.8f, 24,
                 dim, dim, 0.0f, 1.0f);
-    drawEllipse(cx, cy_grn, 6.8f, 6.8f, 24,
+    drawEllipse(0.0f, SIGNAL_GREEN_Y, 6.8f, 6.8f, 24,
                 0.0f, dim, 0.0f, 1.0f);
+}
+
+// Lit lamp with its glow
+void drawSignalLight(float r, float g, float b) {
+    setBlend(true);
+    drawGlowSprite(GLOW_SIGNAL, 0.0f, 0.0f, 1.0f, 1.0f, r, g, b);
+}
+
+// White lit lamp, tinted per instance
+void drawSignalLightShape() {
+    drawSignalLight(1.0f, 1.0f, 1.0f);
+}
+
+// Lamp a signal shows at the current time
+enum SignalLamp { SIGNAL_RED, SIGNAL_GREEN, SIGNAL_YELLOW };
+
+// Height in the housing and colour of each lit lamp, by SignalLamp
+const float SIGNAL_LIGHTS[3][4] = {
+    { SIGNAL_RED_Y,    1.0f, 0.18f, 0.18f },
+    { SIGNAL_GREEN_Y,  0.4f, 1.0f,  0.45f },
+    { SIGNAL_YELLOW_Y, 1.0f, 0.86f, 0.2f  }
+};
+
+SignalLamp signalLamp(float phaseOffsetSec) {
+    float t = fmodf(trafficTimer + phaseOffsetSec, 6.0f);
+    if (t < 2.5f) return SIGNAL_RED;
+    if (t < 5.0f) return SIGNAL_GREEN;
+    return SIGNAL_YELLOW;
+}
+
+// Queue an animated traffic signal
+void drawTrafficSignal(float x, float bridgeY, float phaseOffsetSec) {
+    propInstance(PROP_SIGNAL_HOUSING, x, bridgeY);
+
+    const float* L = SIGNAL_LIGHTS[signalLamp(phaseOffsetSec)];
+    propInstance(PROP_SIGNAL_LIGHT, x, bridgeY + L[0], 1.0f, 1.0f,
+                 L[1], L[2], L[3]);
+}
+
+// Signal poles on the bridge: first (leftmost) and last (rightmost)
+const float SIGNAL_BRIDGE_Y = 120.0f;
+const float SIGNAL_X[2]     = { 40.0f, V_WIDTH - 40.0f };
+const float SIGNAL_PHASE[2] = { 0.0f, 3.0f };
+
+// Draw all traffic signals
+void drawTrafficSignals() {
+    if (drawAnimMesh(ANIM_MESH_SIGNALS)) return;
+
+    for(int i = 0; i < 2; i++)
+        drawTrafficSignal(SIGNAL_X[i], SIGNAL_BRIDGE_Y, SIGNAL_PHASE[i]);
+
+    flushProps(PROP_SIGNAL_HOUSING);
+    flushProps(PROP_SIGNAL_LIGHT);
+}
+
+// ==================== TRAIN (ANIMATED) ====================
+
+// Rim and hub of a train wheel
+void drawWheelShape() {
+    setBlend(true);
+    drawEllipse(0.0f, 0.0f, 12.0f, 12.0f, 32,
+                0.08f, 0.08f, 0.10f, 1.0f);  // Rim
+    drawEllipse(0.0f, 0.0f, 5.5f, 5.5f, 24,
+                0.2f, 0.2f, 0.22f, 1.0f);    // Hub
+}
+
+// Car bodies, roofs and stripes in train-local coordinates
+void drawTrainBodyShape() {
+    float bodyR = 0.95f, bodyG = 0.72f, bodyB = 0.18f;
+    float roofR = 0.14f, roofG = 0.14f, roofB = 0.18f;
+    float carW = 140.0f, carH = 64.0f;
+
+    for(int car = 0; car < 4; ++car) {
+        drawRect(-car * (carW + 8.0f), 0, carW, carH,
+                 bodyR, bodyG, bodyB, 1.0f);
+        drawRect(-car * (carW + 8.0f), carH - 12.0f, carW, 12.0f,
+                 roofR, roofG, roofB, 1.0f);
+        drawRect(-car * (carW + 8.0f), 10.0f, carW, 6.0f,
+                 0.92f, 0.58f, 0.16f, 1.0f);
+    }
+}
+
+// Flickering car windows in train-local coordinates
+void drawTrainWindows() {
+    float carW = 140.0f;
+    for(int car = 0; car < 4; ++car) {
+        for(float wx = 12.0f; wx < carW - 12.0f; wx += 34.0f) {
+            float wy = 26.0f + frandf() * 2.0f;
+            drawRect(-car * (carW + 8.0f) + wx, wy,
+                     24.0f, 20.0f,
+                     1.0f, 0.95f, 0.45f,
+                     0.96f + frandf() * 0.04f);
+        }
+    }
+}
+
+// Front light, its glow and the wheels in train-local coordinates
+void drawTrainFrontShape() {
+    float trackY = 170.0f;
+
+    // Front light
+    drawRect(16.0f, 18.0f, 10.0f, 18.0f,
+             1.0f, 0.98f, 0.78f);
+    drawRadialGlow(36.0f, trackY - 8.0f + 26.0f, 60.0f,
+                   1.0f, 0.95f, 0.6f);
+
+    // Wheels
+    for(int w = 0; w < 8; ++w) {
+        float wx = -w * 58.0f + 24.0f;
+        float wy = -8.0f;
+        propInstance(PROP_WHEEL, wx, wy);
+    }
+
+    // Extra front wheel (first compartment)
+    propInstance(PROP_WHEEL, 92.0f, -8.0f);   // Position near front nose
+
+    flushProps(PROP_WHEEL);
+}
+
+// Draw an animated train
+void drawTrain() {
+    float trackY = 170.0f;
+    bool animated = drawAnimMesh(ANIM_MESH_TRAIN_BODY);
+    pushTransform();
+        translate2D(trainPos, trackY - 8.0f);
+        if (!animated) drawTrainBodyShape();
+        drawTrainWindows();
+        if (!animated || !drawAnimMesh(ANIM_MESH_TRAIN_FRONT))
+            drawTrainFrontShape();
+    popTransform();
+}
+
+// ==================== DISTANT LIGHTS, SUN ====================
+
+// Draw distant city lights
+void drawDistantLights() {
+    setPointSize(2.0f);
+    for(int i = 0; i < 180; i++) {
+        float x = frandf() * V_WIDTH;
+        float y = 120.0f + frandf() * 360.0f;
+        float b = 0.5f + frandf() * 0.6f;
+        setColor(0.95f * b, 0.72f * b, 0.45f * b);
+        drawPoint(x, y);
+    }
+}
+
+const float SUN_X = V_WIDTH * 0.33f;
+const float SUN_Y = V_HEIGHT * 0.36f;
+
+// Draw the sun disc
+void drawSun() {
+    drawEllipse(SUN_X, SUN_Y, 26.0f, 26.0f, 60,
+                1.0f, 0.95f, 0.64f, 1.0f);
+}
+
+// Draw the sun's glow and lens flare; soft, so fine at low resolution
+void drawSunFlares() {
+    float cx = SUN_X;
+    float cy = SUN_Y;
+    drawRadialGlow(cx, cy, 100.0f,
+                   1.0f, 0.72f, 0.3f);
+    pushTransform();
+        translate2D(cx, cy);
+        drawEllipse(0, 0, 220.0f, 18.0f, 32,
+                    1.0f, 0.62f, 0.22f, 0.045f);
+    popTransform();
+}
+
+// ==================== WIRES/POLES (OLD CATENARY) ====================
+
+// Draw poles and overhead wires for train
+void drawPolesAndWires() {
+    float trackY = 170.0f;
+    for(float x = 40.0f; x < V_WIDTH; x += 160.0f) {
+        drawRect(x - 5.0f, trackY, 10.0f, 220.0f,
+                 0.12f, 0.12f, 0.14f);
+        drawRect(x - 24.0f, trackY + 178.0f, 48.0f, 6.0f,
+                 0.12f, 0.12f, 0.14f);
+    }
+    setColor(0.22f, 0.22f, 0.26f);
+    drawLine(0, trackY + 184.0f, V_WIDTH, trackY + 184.0f);
+    drawLine(0, trackY + 196.0f, V_WIDTH, trackY + 196.0f);
+}
+
+// Draw moon with glow effect
+void drawMoon(float cx, float cy, float radius) {
+    setBlend(true);
+
+    // Glow
+    if (gLightHalos)
+        batchEllipseFan(cx, cy, radius * 3.0f, radius * 3.0f, 60,
+                        0.9f, 0.9f, 1.0f, 0.25f, 0.0f);
+
+    // Moon body
+    drawEllipse(cx, cy, radius, radius, 60,
+                0.97f, 0.97f, 1.0f, 1.0f);
+
+    setBlend(false);
+}
+
+// Draw Japanese-style elevated viaduct
+void drawJapaneseViaduct(float trackY) {
+    float deckThickness = 22.0f;
+    float deckY = trackY - deckThickness;
+    float pillarTop = deckY;
+    float groundY = 0.0f;
+
+    // ===================== VIADUCT DECK =====================
+    drawRect(0, deckY, V_WIDTH, deckThickness,
+             0.78f, 0.78f, 0.82f, 1.0f);   // Light concrete
+
+    // Deck edge shadow
+    drawRect(0, deckY, V_WIDTH, 3.0f,
+             0.55f, 0.55f, 0.58f, 1.0f);
+
+    // ===================== SIDE BARRIERS =====================
+    for(float x = 0; x < V_WIDTH; x += 32.0f) {
+        drawRect(x, deckY + deckThickness - 6.0f,
+                 20.0f, 4.0f,
+                 0.62f, 0.62f, 0.65f, 1.0f);
+    }
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    if (redOn) {
-        drawEllipse(cx, cy_red, 6.8f, 6.8f, 24,
-                    1.0f, 0.18f, 0.18f, 1.0f);
-        drawRadialGlow(cx, cy_red, 10.0f, 36.0f, 24,
-                       1.0f, 0.18f, 0.18f);
+    // ===================== SUPPORT PILLARS =====================
+    for(float x = 80.0f; x < V_WIDTH; x += 160.0f) {
+        // Main pillar
+        drawRect(x - 18.0f, groundY,
+                 36.0f, pillarTop - groundY,
+                 0.70f, 0.70f, 0.74f, 1.0f);
+
+        // Pillar base
+        drawRect(x - 28.0f, groundY,
+                 56.0f, 14.0f,
+                 0.55f, 0.55f, 0.58f, 1.0f);
+
+        // Top cap
+        drawRect(x - 26.0f, pillarTop - 6.0f,
+                 52.0f, 6.0f,
+                 0.60f, 0.60f, 0.63f, 1.0f);
+    }
+
+    // ===================== SHADOW UNDER DECK =====================
+    setBlend(true);
+    drawRect(0, deckY - 6.0f, V_WIDTH, 6.0f,
+             0.0f, 0.0f, 0.0f, 0.18f);
+    setBlend(false);
+}
+
+// Draw animated water reflections
+void drawAnimatedWater(float waterTopY) {
+    if (waterTopY == gAnimWaterTop && drawAnimMesh(ANIM_MESH_WATER)) return;
+
+    // Base water color
+    drawRect(0, 0, V_WIDTH, waterTopY,
+             0.06f, 0.18f, 0.32f, 1.0f);
+
+    setBlend(true);
+
+    // Moving horizontal reflection streaks
+    for(int i = 0; i < 40; i++) {
+        float y = fmodf(i * 14.0f + waterTime * 22.0f, waterTopY);
+        float x = fmodf(i * 63.0f + waterTime * 40.0f, V_WIDTH);
+        float w = 60.0f + 40.0f * sinf(waterTime + i);
+        float a = 0.04f + 0.03f * sinf(waterTime * 1.4f + i);
+
+        drawRect(x, y, w, 2.0f,
+                 0.95f, 0.75f, 0.45f, a);
+    }
+
+    // Soft vertical shimmer near bridge
+    for(int i = 0; i < 12; i++) {
+        float x = i * (V_WIDTH / 12.0f) + sinf(waterTime + i) * 8.0f;
+        drawRect(x, waterTopY - 12.0f,
+                 6.0f, 12.0f,
+                 0.9f, 0.7f, 0.4f, 0.08f);
+    }
+
+    setBlend(false);
+}
+
+// Lamp posts along the bridge
+const float LAMP_GROUND_Y = 120.0f;  // Bridge / road height
+const float LAMP_X[3] = { 180.0f, 420.0f, 660.0f };
+
+// Draw three DDA lamp posts
+void drawThreeDDALamps() {
+    for(int i = 0; i < 3; i++)
+        drawDDALampPost(LAMP_X[i], LAMP_GROUND_Y);
+
+    flushProps(PROP_LAMP_POST);
+    flushProps(PROP_LAMP_GLOW);
+}
+
+// Build the boat's hull and cabin meshes
+void buildSpeedBoatMeshes() {
+    // ================= MAIN HULL (ANGLED) =================
+    const float hull[] = {
+        0, 2,       // Rear bottom
+        10, 0,
+        95, 0,      // Bottom mid
+        120, 9,     // Sharp bow
+        95, 18,     // Upper hull
+        12, 18,
+        0, 14       // Rear top
+    };
+    meshAddPolygon(gMeshes[MESH_BOAT_HULL], hull, 7,
+                   0.12f, 0.12f, 0.15f);   // Dark steel gray
+
+    IndexedMesh& cabinMesh = gMeshes[MESH_BOAT_CABIN];
+
+    // ================= BLACK STRIPE =================
+    meshAddRect(cabinMesh, 14, 7, 70, 3,
+                0.0f, 0.0f, 0.0f);
+
+    // ================= CABIN (SLOPED) =================
+    const float cabin[] = { 30, 18,  70, 18,  60, 34,  34, 34 };
+    meshAddPolygon(cabinMesh, cabin, 4, 0.88f, 0.88f, 0.90f);
+
+    // ================= FRONT WINDOW =================
+    const float frontWindow[] = { 38, 22,  56, 22,  50, 30,  40, 30 };
+    meshAddPolygon(cabinMesh, frontWindow, 4, 0.30f, 0.55f, 0.75f);
+
+    // ================= SIDE WINDOW =================
+    meshAddRect(cabinMesh, 58, 22, 10, 6,
+                0.30f, 0.55f, 0.75f);
+}
+
+// Speed boat at unit scale, stern at the origin
+void drawSpeedBoatShape() {
+    drawMesh(MESH_BOAT_HULL);
+
+    // ================= HULL TOP EDGE =================
+    setLineWidth(2.0f);   // as left by the bridge rails
+    setColor(0.25f, 0.25f, 0.28f);
+    drawLine(12, 18, 95, 18);
+
+    drawMesh(MESH_BOAT_CABIN);
+
+    setBlend(false);
+}
+
+// Draw speed boat
+void drawSpeedBoat() {
+    if (drawAnimMesh(ANIM_MESH_BOAT)) return;
+
+    float waterY = 65.0f;
+
+    pushTransform();
+    translate2D(boatPos, waterY);
+
+    // Slight scale up
+    scale2D(1.4f, 1.4f);
+
+    drawSpeedBoatShape();
+
+    popTransform();
+}
+
+// Build the bat mesh: wings and body at unit scale
+void buildBatMesh() {
+    // Both wings and the body as one outline
+    const float bat[] = {
+        -30, 0,  -18, 8,  0, 0,     // left wing
+        18, 8,  30, 0,              // right wing
+        4, 0,  0, -10,  -4, 0       // body
+    };
+    meshAddPolygon(gMeshes[MESH_BAT], bat, 8,
+                   0.05f, 0.05f, 0.07f);  // Dark bat color
+}
+
+// Queue a bat
+void drawBat(float cx, float cy, float scale) {
+    propInstance(PROP_BAT, cx, cy, scale, scale);
+}
+
+// Draw multiple bats in sky
+void drawBatsInSky() {
+    drawBat(120, 520, 0.7f);
+    drawBat(160, 540, 0.5f);
+    drawBat(210, 515, 0.6f);
+
+    drawBat(520, 560, 0.8f);
+    drawBat(560, 540, 0.6f);
+
+    drawBat(680, 510, 0.7f);
+
+    flushProps(PROP_BAT);
+}
+
+// Triangulate the mesh library
+void initMeshes() {
+    buildSpeedBoatMeshes();
+    buildBatMesh();
+}
+
+// Build the prop meshes and, if available, the instancing shader
+void initProps() {
+    if (gHasGL33) {
+        gPropProgram = buildProgram(PROP_VS, SHAPE_FS);
+        if (gPropProgram) {
+            gPropViewLoc = glGetUniformLocation(gPropProgram, "uView");
+            gPropTexturedLoc = glGetUniformLocation(gPropProgram, "uTextured");
+            glGenBuffers(1, &gPropInstanceVbo);
+        }
+    }
+    captureProp(PROP_WINDOW, drawWindowShape);
+    captureProp(PROP_WHEEL, drawWheelShape);
+    capturePropMesh(PROP_BAT, MESH_BAT);
+    captureProp(PROP_LAMP_POST, drawLampPostShape);
+    captureProp(PROP_LAMP_GLOW, drawLampGlowShape);
+    captureProp(PROP_SIGNAL_HOUSING, drawSignalHousingShape);
+    captureProp(PROP_SIGNAL_LIGHT, drawSignalLightShape);
+}
+
+// Record one traffic signal: static housing plus its three lamps, each
+// visible only inside its slice of the 6 s cycle
+void buildSignalAnimMesh(AnimMesh& m, float x, float bridgeY, float phase) {
+    animRecordBegin();
+    pushTransform();
+        translate2D(x, bridgeY);
+        drawSignalHousingShape();
+    popTransform();
+    animRecordEnd(m, ANIM_STATIC);
+
+    const float lampY[3]  = { SIGNAL_RED_Y, SIGNAL_GREEN_Y, SIGNAL_YELLOW_Y };
+    const float lampRGB[3][3] = {
+        { 1.0f, 0.18f, 0.18f }, { 0.4f, 1.0f, 0.45f }, { 1.0f, 0.86f, 0.2f }
+    };
+    const float litFrom[3]  = { 0.0f, 2.5f, 5.0f };
+    const float litUntil[3] = { 2.5f, 5.0f, 6.0f };
+    for(int i = 0; i < 3; i++) {
+        animRecordBegin();
+        pushTransform();
+            translate2D(x, bridgeY + lampY[i]);
+            drawSignalLight(lampRGB[i][0], lampRGB[i][1], lampRGB[i][2]);
+        popTransform();
+        animRecordEnd(m, ANIM_SIGNAL, phase, litFrom[i], litUntil[i]);
+    }
+}
+
+// Build the animated meshes and their program (needs GL 3.3)
+void initAnimMeshes() {
+    if (!gHasGL33) return;
+    gAnimProgram = buildProgram(ANIM_VS, SHAPE_FS);
+    if (!gAnimProgram) return;
+    gAnimViewLoc = glGetUniformLocation(gAnimProgram, "uView");
+    gAnimTexturedLoc = glGetUniformLocation(gAnimProgram, "uTextured");
+    gAnimClockLoc = glGetUniformLocation(gAnimProgram, "uClock");
+    gAnimWaterLoc = glGetUniformLocation(gAnimProgram, "uWater");
+    bool savedBlend = gBatch.blend;
+    float savedWidth = gBatch.lineWidth;
+    gBatch.blend = false;
+
+    // Water: base, 40 streaks (unit squares), 12 shimmer bars
+    AnimMesh& water = gAnimMeshes[ANIM_MESH_WATER];
+    gAnimWaterTop = 120.0f;   // bridge height used by display()
+    animRecordBegin();
+    drawRect(0, 0, V_WIDTH, gAnimWaterTop,
+             0.06f, 0.18f, 0.32f, 1.0f);
+    animRecordEnd(water, ANIM_STATIC);
+    setBlend(true);
+    for(int i = 0; i < 40; i++) {
+        animRecordBegin();
+        drawRect(0.0f, 0.0f, 1.0f, 1.0f, 0.95f, 0.75f, 0.45f, 1.0f);
+        animRecordEnd(water, ANIM_STREAK, (float)i);
+    }
+    for(int i = 0; i < 12; i++) {
+        animRecordBegin();
+        drawRect(i * (V_WIDTH / 12.0f), gAnimWaterTop - 12.0f,
+                 6.0f, 12.0f,
+                 0.9f, 0.7f, 0.4f, 0.08f);
+        animRecordEnd(water, ANIM_SHIMMER, (float)i);
+    }
+    setBlend(false);
+
+    // Traffic signals
+    for(int i = 0; i < 2; i++)
+        buildSignalAnimMesh(gAnimMeshes[ANIM_MESH_SIGNALS],
+                            SIGNAL_X[i], SIGNAL_BRIDGE_Y, SIGNAL_PHASE[i]);
+
+    // Train at trainPos = 0; the shader adds the current position
+    float trackY = 170.0f;
+    pushTransform();
+        translate2D(0.0f, trackY - 8.0f);
+        animRecordBegin();
+        drawTrainBodyShape();
+        animRecordEnd(gAnimMeshes[ANIM_MESH_TRAIN_BODY], ANIM_TRAIN);
+        animRecordBegin();
+        drawTrainFrontShape();
+        animRecordEnd(gAnimMeshes[ANIM_MESH_TRAIN_FRONT], ANIM_TRAIN);
+    popTransform();
+
+    // Boat at boatPos = 0
+    float waterY = 65.0f;
+    pushTransform();
+        translate2D(0.0f, waterY);
+        scale2D(1.4f, 1.4f);
+        animRecordBegin();
+        drawSpeedBoatShape();
+        animRecordEnd(gAnimMeshes[ANIM_MESH_BOAT], ANIM_BOAT);
+    popTransform();
+
+    for(int i = 0; i < ANIM_MESH_COUNT; i++)
+        animUpload(gAnimMeshes[i]);
+    gBatch.blend = savedBlend;
+    gBatch.lineWidth = savedWidth;
+}
+
+// ==================== LAYER CACHE ====================
+
+// Scene layers whose pixels never change between frames
+enum StaticLayer {
+    LAYER_SKY,
+    LAYER_CLOUDS,
+    LAYER_SUN_CLOUDS,      // sun glow and the cloud banks over it
+    LAYER_SKYLINES,
+    LAYER_POWER,
+    LAYER_VIADUCT,
+    LAYER_COUNT
+};
+
+// Offscreen copy of one static layer (premultiplied RGBA)
+struct CachedLayer {
+    GLuint fbo, tex;
+    int w, h;              // texture size in pixels
+    unsigned key;          // hash of the parameters it was drawn with
+    bool valid;
+};
+
+CachedLayer gLayers[LAYER_COUNT];
+
+// Resolution divisor per layer. Sky, clouds and glows are soft enough
+// to be drawn at 1/2 or 1/4 size and bilinearly upsampled, which cuts
+// the fill of their stacked translucent ellipses by 4-16x.
+int gLayerDownsample[LAYER_COUNT] = { 4, 2, 4, 1, 1, 1 };
+bool gLowResLayers = true;
+
+CachedLayer gSceneLayer;   // the whole previous frame, see DIRTY REGIONS
+GLuint gSceneFbo = 0;      // framebuffer the scene is being drawn into
+bool gSceneScissor = false; // scene drawing is clipped to a dirty rect
+bool gLayerCacheEnabled = true;
+int gLayerRenders = 0;     // how often any layer was (re)drawn offscreen
+StaticLayer gLayerDrawing = LAYER_COUNT;
+
+// FNV-1a hash over a list of layer parameters
+unsigned hashParams(const float* params, int n, unsigned h = 2166136261u) {
+    const unsigned char* p = (const unsigned char*)params;
+    for(size_t i = 0; i < n * sizeof(float); i++) {
+        h ^= p[i];
+        h *= 16777619u;
     }
-    if (greenOn) {
-        drawEllipse(cx, cy_grn, 6.8f, 6.8f, 24,
-                    0.4f, 1.0f, 0.45f, 1.0f);
-        drawRadialGlow(cx, cy_grn, 10.0f, 36.0f, 24,
-                       0.4f, 1.0f, 0.45f);
+    return h;
+}
+
+// Viewport for drawing the scene: the whole offscreen scene target at
+// render resolution, or the letterboxed window viewport
+void setSceneViewport() {
+    if (gHeadless) {
+        gPixelScale = gRenderH / V_HEIGHT;   // the software frame
+        return;
     }
-    if (yellowOn) {
-        drawEllipse(cx, cy_yel, 6.8f, 6.8f, 24,
-                    1.0f, 0.86f, 0.2f, 1.0f);
-        drawRadialGlow(cx, cy_yel, 10.0f, 36.0f, 24,
-                       1.0f, 0.86f, 0.2f);
+    if (gSceneFbo) {
+        glViewport(0, 0, gRenderW, gRenderH);
+        gPixelScale = gRenderH / V_HEIGHT;
+    } else {
+        glViewport(gViewX, gViewY, gViewW, gViewH);
+        gPixelScale = gViewH / V_HEIGHT;
     }
-    glDisable(GL_BLEND);
 }
 
-// Draw all traffic signals
-void drawTrafficSignals() {
-    float bridgeY = 120.0f;
-
-    // First traffic signal (leftmost)
-    drawTrafficSignal(40.0f, bridgeY, 0.0f);
-
-    // Last traffic signal (rightmost)
-    drawTrafficSignal(V_WIDTH - 40.0f, bridgeY, 3.0f);
+// Force every cached layer to be redrawn on next use
+void invalidateLayerCache() {
+    for(int i = 0; i < LAYER_COUNT; i++)
+        gLayers[i].valid = false;
+    gSceneLayer.valid = false;
 }
 
-// ==================== TRAIN (ANIMATED) ====================
+// (Re)create a render target of w x h pixels
+bool allocTarget(CachedLayer& L, int w, int h, GLenum minFilter,
+                 GLenum magFilter) {
+    if (L.fbo && L.w == w && L.h == h) return true;
+    if (!L.fbo) {
+        glGenFramebuffers(1, &L.fbo);
+        glGenTextures(1, &L.tex);
+    }
+    L.w = w;
+    L.h = h;
+    stateBindTexture(L.tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, magFilter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, L.w, L.h, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindFramebuffer(GL_FRAMEBUFFER, L.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, L.tex, 0);
+    bool ok = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, gSceneFbo);
+    L.valid = false;
+    return ok;
+}
 
-// Draw an animated train
-void drawTrain() {
-    float trackY = 170.0f;
-    glPushMatrix();
-        glTranslatef(trainPos, trackY - 8.0f, 0);
-
-        float bodyR = 0.95f, bodyG = 0.72f, bodyB = 0.18f;
-        float roofR = 0.14f, roofG = 0.14f, roofB = 0.18f;
-        float carW = 140.0f, carH = 64.0f;
-
-        // Draw train cars
-        for(int car = 0; car < 4; ++car) {
-            drawRect(-car * (carW + 8.0f), 0, carW, carH,
-                     bodyR, bodyG, bodyB, 1.0f);
-            drawRect(-car * (carW + 8.0f), carH - 12.0f, carW, 12.0f,
-                     roofR, roofG, roofB, 1.0f);
-            drawRect(-car * (carW + 8.0f), 10.0f, carW, 6.0f,
-                     0.92f, 0.58f, 0.16f, 1.0f);
-
-            // Windows
-            for(float wx = 12.0f; wx < carW - 12.0f; wx += 34.0f) {
-                float wy = 26.0f + frandf() * 2.0f;
-                drawRect(-car * (carW + 8.0f) + wx, wy,
-                         24.0f, 20.0f,
-                         1.0f, 0.95f, 0.45f,
-                         0.96f + frandf() * 0.04f);
-            }
-        }
+// (Re)create the layer's render target at the current render size,
+// divided by downsample
+bool allocLayerTarget(CachedLayer& L, int downsample = 1,
+                      GLenum minFilter = GL_NEAREST,
+                      GLenum magFilter = GL_NEAREST) {
+    return allocTarget(L, std::max(1, (gRenderW + downsample - 1) / downsample),
+                       std::max(1, (gRenderH + downsample - 1) / downsample),
+                       minFilter, magFilter);
+}
 
-        // Front light
-        drawRect(16.0f, 18.0f, 10.0f, 18.0f,
-                 1.0f, 0.98f, 0.78f);
-        drawRadialGlow(36.0f, trackY - 8.0f + 26.0f,
-                       18.0f, 60.0f, 20,
-                       1.0f, 0.95f, 0.6f);
+// Start a static layer. Returns true if the caller has to draw its
+// content: either straight to the screen (cache off) or into the
+// layer's offscreen target because the cached copy is stale.
+bool beginCachedLayer(StaticLayer id, unsigned key) {
+    if (!gLayerCacheEnabled || !gHasFramebuffers) return true;
+    CachedLayer& L = gLayers[id];
+    int ds = gLowResLayers ? gLayerDownsample[id] : 1;
+    GLenum filter = ds > 1 ? GL_LINEAR : GL_NEAREST;
+    if (!allocLayerTarget(L, ds, filter, filter)) {
+        gLayerCacheEnabled = false;
+        return true;
+    }
+    if (L.valid && L.key == key) return false;
+
+    batchBarrier();
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, L.fbo);
+    glViewport(0, 0, L.w, L.h);
+    gPixelScale = L.h / V_HEIGHT;
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    L.key = key;
+    gLayerDrawing = id;
+    gLayerRenders++;
+    return true;
+}
 
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+// Finish a static layer and composite its cached copy onto the screen
+void endCachedLayer(StaticLayer id) {
+    if (!gLayerCacheEnabled || !gHasFramebuffers) return;
+    CachedLayer& L = gLayers[id];
+    if (gLayerDrawing == id) {
+        batchBarrier();
+        glBindFramebuffer(GL_FRAMEBUFFER, gSceneFbo);
+        setSceneViewport();
+        if (gSceneScissor) glEnable(GL_SCISSOR_TEST);
+        glClearColor(0.0f, 0.0f, 0.02f, 1.0f);
+        gLayerDrawing = LAYER_COUNT;
+        L.valid = true;
+    }
+    drawTexturedRect(0, 0, V_WIDTH, V_HEIGHT, L.tex, BLEND_PREMULTIPLIED);
+}
 
-        // Wheels
-        for(int w = 0; w < 8; ++w) {
-            float wx = -w * 58.0f + 24.0f;
-            float wy = -8.0f;
-            drawEllipse(wx, wy, 12.0f, 12.0f, 32,
-                        0.08f, 0.08f, 0.10f, 1.0f);
-            drawEllipse(wx, wy, 5.5f, 5.5f, 24,
-                        0.2f, 0.2f, 0.22f, 1.0f);
+// ==================== TRANSIENT TARGETS ====================
+
+// Targets that only live for part of a frame, like the bloom pyramid,
+// are borrowed from a shared pool and handed back once the last pass
+// reading them has run. A request gets the smallest free target that
+// is big enough and uses its lower-left corner, so passes whose targets
+// are never alive at the same time share memory, and the pool only
+// grows with the peak number of live targets, not with the passes.
+struct TransientTarget {
+    CachedLayer rt;        // rt.w x rt.h is the allocated size
+    int w, h;              // area used by the current owner
+    bool busy;
+};
+
+std::vector<TransientTarget> gTransients;
+int gTransientRequests = 0;   // acquisitions this frame, vs. the pool size
+
+// Borrow a target of at least w x h pixels; returns its pool index or -1
+int acquireTarget(int w, int h) {
+    int best = -1;
+    for(size_t i = 0; i < gTransients.size(); i++) {
+        const CachedLayer& rt = gTransients[i].rt;
+        if (gTransients[i].busy || rt.w < w || rt.h < h) continue;
+        if (best < 0 ||
+            rt.w * rt.h < gTransients[best].rt.w * gTransients[best].rt.h)
+            best = (int)i;
+    }
+    if (best < 0) {
+        TransientTarget t = {};
+        if (!allocTarget(t.rt, w, h, GL_LINEAR, GL_LINEAR)) {
+            glDeleteFramebuffers(1, &t.rt.fbo);
+            glDeleteTextures(1, &t.rt.tex);
+            return -1;
         }
+        gTransients.push_back(t);
+        best = (int)gTransients.size() - 1;
+    }
+    TransientTarget& t = gTransients[best];
+    t.w = w;
+    t.h = h;
+    t.busy = true;
+    gTransientRequests++;
+    return best;
+}
 
-        // Extra front wheel (first compartment)
-        {
-            float wx = 92.0f;   // Position near front nose
-            float wy = -8.0f;
+void releaseTarget(int id) {
+    if (id >= 0) gTransients[id].busy = false;
+}
 
-            drawEllipse(wx, wy, 12.0f, 12.0f, 32,
-                        0.08f, 0.08f, 0.10f, 1.0f);  // Rim
-            drawEllipse(wx, wy, 5.5f, 5.5f, 24,
-                        0.2f, 0.2f, 0.22f, 1.0f);    // Hub
-        }
+// Free the whole pool, e.g. when the render size changes
+void resetTransients() {
+    for(size_t i = 0; i < gTransients.size(); i++) {
+        glDeleteFramebuffers(1, &gTransients[i].rt.fbo);
+        glDeleteTextures(1, &gTransients[i].rt.tex);
+    }
+    gTransients.clear();
+}
 
-        glDisable(GL_BLEND);
-    glPopMatrix();
+size_t transientBytes() {
+    size_t bytes = 0;
+    for(size_t i = 0; i < gTransients.size(); i++)
+        bytes += (size_t)gTransients[i].rt.w * gTransients[i].rt.h * 4;
+    return bytes;
 }
 
-// ==================== DISTANT LIGHTS, SUN ====================
+// ==================== BLOOM ====================
+
+// Screen-space bloom: bright pixels of the finished scene are extracted
+// at half resolution, blurred at each level of a pyramid of smaller
+// targets and summed back up, then added over the frame. The cost only
+// depends on the render size, not on how many lights are on screen, so
+// while bloom runs the glow sprites drop their halo layers. The pyramid
+// lives in transient targets; each level's blur scratch is returned
+// right away and reused by the next, smaller level.
+const int BLOOM_LEVELS = 5;   // 1/2 .. 1/32 of the render size
+
+const char* BLOOM_VS =
+    "#version 330\n"
+    "out vec2 vUV;\n"
+    "void main() {\n"
+    "    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+    "    vUV = p;\n"
+    "    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+
+// uPass 0: bright pass, 1: 4-tap box filter (down- and upsampling),
+// 2: 9-tap Gaussian along uStep.zw in 5 bilinear fetches
+const char* BLOOM_FS =
+    "#version 330\n"
+    "in vec2 vUV;\n"
+    "uniform sampler2D uTex;\n"
+    "uniform int uPass;\n"
+    "uniform vec4 uStep;\n"    // source texel size, tap offset or direction
+    "uniform vec2 uBright;\n"  // threshold, soft knee
+    "uniform vec2 uUVScale;\n" // part of the source texture in use
+    "out vec4 fragColor;\n"
+    "vec3 tap(vec2 o) {\n"
+    "    vec2 uv = clamp(vUV * uUVScale + o * uStep.xy,\n"
+    "                    uStep.xy * 0.5, uUVScale - uStep.xy * 0.5);\n"
+    "    return texture(uTex, uv).rgb;\n"
+    "}\n"
+    "void main() {\n"
+    "    vec3 c;\n"
+    "    if (uPass == 2) {\n"
+    "        vec2 d = uStep.zw;\n"
+    "        c = tap(vec2(0.0)) * 0.2270270;\n"
+    "        c += (tap(d * 1.3846154) + tap(-d * 1.3846154)) * 0.3162162;\n"
+    "        c += (tap(d * 3.2307692) + tap(-d * 3.2307692)) * 0.0702703;\n"
+    "    } else {\n"
+    "        vec2 o = uStep.zw;\n"
+    "        c = 0.25 * (tap(o) + tap(-o) + tap(vec2(o.x, -o.y)) +\n"
+    "                    tap(vec2(-o.x, o.y)));\n"
+    "        if (uPass == 0) {\n"
+    "            float l = max(c.r, max(c.g, c.b));\n"
+    "            c *= smoothstep(uBright.x - uBright.y,\n"
+    "                            uBright.x + uBright.y, l);\n"
+    "        }\n"
+    "    }\n"
+    "    fragColor = vec4(c, 0.0);\n"   // alpha 0: composites additively
+    "}\n";
+
+struct Bloom {
+    bool enabled;
+    GLuint program, vao;
+    GLint passLoc, stepLoc, brightLoc, uvScaleLoc;
+    float threshold, knee;             // brightest channel of emissive pixels
+    float intensity;
+};
+
+Bloom gBloom = { true, 0, 0, -1, -1, -1, -1, 0.965f, 0.02f, 0.6f };
+
+// Build the bloom program; needs GLSL 3.30 and framebuffers
+bool initBloom() {
+    if (!gHasGL33 || !gHasFramebuffers) return false;
+    gBloom.program = buildProgram(BLOOM_VS, BLOOM_FS);
+    if (!gBloom.program) return false;
+    gBloom.passLoc = glGetUniformLocation(gBloom.program, "uPass");
+    gBloom.stepLoc = glGetUniformLocation(gBloom.program, "uStep");
+    gBloom.brightLoc = glGetUniformLocation(gBloom.program, "uBright");
+    gBloom.uvScaleLoc = glGetUniformLocation(gBloom.program, "uUVScale");
+    glGenVertexArrays(1, &gBloom.vao);
+    return true;
+}
 
-// Draw distant city lights
-void drawDistantLights() {
-    glPointSize(2.0f);
-    glBegin(GL_POINTS);
-        for(int i = 0; i < 180; i++) {
-            float x = frandf() * V_WIDTH;
-            float y = 120.0f + frandf() * 360.0f;
-            float b = 0.5f + frandf() * 0.6f;
-            glColor3f(0.95f * b, 0.72f * b, 0.45f * b);
-            glVertex2f(x, y);
-        }
-    glEnd();
-}
-
-// Draw sun with lens flares
-void drawSunAndFlares() {
-    float cx = V_WIDTH * 0.33f;
-    float cy = V_HEIGHT * 0.36f;
-    drawEllipse(cx, cy, 26.0f, 26.0f, 60,
-                1.0f, 0.95f, 0.64f, 1.0f);
-    drawRadialGlow(cx, cy, 36.0f, 100.0f, 40,
-                   1.0f, 0.72f, 0.3f);
-    glPushMatrix();
-        glTranslatef(cx, cy, 0);
-        drawEllipse(0, 0, 220.0f, 18.0f, 32,
-                    1.0f, 0.62f, 0.22f, 0.045f);
-    glPopMatrix();
+bool bloomActive() {
+    return gBloom.enabled && gBloom.program;
 }
 
-// ==================== WIRES/POLES (OLD CATENARY) ====================
+// Draw one pass over the used area of dst, sampling the used area of src
+void bloomPass(const TransientTarget& dst, const TransientTarget& src,
+               int pass, float dx, float dy, bool add) {
+    glBindFramebuffer(GL_FRAMEBUFFER, dst.rt.fbo);
+    glViewport(0, 0, dst.w, dst.h);
+    stateBlend(add);
+    if (add) stateBlendFunc(GL_ONE, GL_ONE, GL_ONE, GL_ONE);
+    stateBindTexture(src.rt.tex);
+    glUniform1i(gBloom.passLoc, pass);
+    glUniform4f(gBloom.stepLoc, 1.0f / src.rt.w, 1.0f / src.rt.h, dx, dy);
+    glUniform2f(gBloom.uvScaleLoc, (float)src.w / src.rt.w,
+                (float)src.h / src.rt.h);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
 
-// Draw poles and overhead wires for train
-void drawPolesAndWires() {
-    float trackY = 170.0f;
-    for(float x = 40.0f; x < V_WIDTH; x += 160.0f) {
-        drawRect(x - 5.0f, trackY, 10.0f, 220.0f,
-                 0.12f, 0.12f, 0.14f);
-        drawRect(x - 24.0f, trackY + 178.0f, 48.0f, 6.0f,
-                 0.12f, 0.12f, 0.14f);
+// Run the pyramid over the finished scene. Returns the transient target
+// holding the sum, which the caller releases, or -1. The caller rebinds
+// its framebuffer afterwards.
+int buildBloom(const CachedLayer& sceneLayer) {
+    stateUseProgram(gBloom.program);
+    stateBindVertexArray(gBloom.vao);
+    glUniform2f(gBloom.brightLoc, gBloom.threshold, gBloom.knee);
+
+    // Down: extract or box-filter, then blur in both directions
+    TransientTarget scene = { sceneLayer, sceneLayer.w, sceneLayer.h, true };
+    int levels[BLOOM_LEVELS];
+    int w = sceneLayer.w, h = sceneLayer.h;
+    for(int i = 0; i < BLOOM_LEVELS; i++) {
+        w = std::max(1, (w + 1) / 2);
+        h = std::max(1, (h + 1) / 2);
+        levels[i] = acquireTarget(w, h);
+        int temp = acquireTarget(w, h);
+        if (levels[i] < 0 || temp < 0) {
+            for(int j = 0; j <= i; j++) releaseTarget(levels[j]);
+            releaseTarget(temp);
+            gBloom.enabled = false;
+            return -1;
+        }
+        // Pool indices stay put, but references die when it grows
+        TransientTarget& L = gTransients[levels[i]];
+        TransientTarget& T = gTransients[temp];
+        if (i == 0) bloomPass(L, scene, 0, 0.5f, 0.5f, false);
+        else        bloomPass(L, gTransients[levels[i - 1]], 1, 1.0f, 1.0f, false);
+        bloomPass(T, L, 2, 1.0f, 0.0f, false);
+        bloomPass(L, T, 2, 0.0f, 1.0f, false);
+        releaseTarget(temp);
+    }
+    // Up: add every level into the one above it
+    for(int i = BLOOM_LEVELS - 2; i >= 0; i--) {
+        bloomPass(gTransients[levels[i]], gTransients[levels[i + 1]], 1,
+                  1.0f, 1.0f, true);
+        releaseTarget(levels[i + 1]);
     }
-    glColor3f(0.22f, 0.22f, 0.26f);
-    glBegin(GL_LINES);
-        glVertex2f(0, trackY + 184.0f); glVertex2f(V_WIDTH, trackY + 184.0f);
-        glVertex2f(0, trackY + 196.0f); glVertex2f(V_WIDTH, trackY + 196.0f);
-    glEnd();
+    return levels[0];
 }
 
-// Draw moon with glow effect
-void drawMoon(float cx, float cy, float radius) {
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+// ==================== DIRTY REGIONS ====================
 
-    // Glow
-    glBegin(GL_TRIANGLE_FAN);
-        glColor4f(0.9f, 0.9f, 1.0f, 0.25f);
-        glVertex2f(cx, cy);
-        for(int i = 0; i <= 60; i++) {
-            float t = 2.0f * M_PI * i / 60.0f;
-            glColor4f(0.9f, 0.9f, 1.0f, 0.0f);
-            glVertex2f(cx + cos(t) * radius * 3.0f,
-                       cy + sin(t) * radius * 3.0f);
-        }
-    glEnd();
+// Most of the frame is identical to the previous one. The last frame
+// is kept in gSceneLayer; every frame the render graph reports the
+// areas its updated passes covered before and cover now, and only those
+// rects are cleared and redrawn, one scissored scene pass per rect.
+// The distant lights twinkle all over the sky, so they are drawn on
+// top of the composited frame instead of being tracked. Dirty rects are
+// in scene target pixels, i.e. at render resolution.
 
-    // Moon body
-    glColor3f(0.97f, 0.97f, 1.0f);
-    glBegin(GL_TRIANGLE_FAN);
-        glVertex2f(cx, cy);
-        for(int i = 0; i <= 60; i++) {
-            float t = 2.0f * M_PI * i / 60.0f;
-            glVertex2f(cx + cos(t) * radius,
-                       cy + sin(t) * radius);
-        }
-    glEnd();
+const int MAX_DIRTY_RECTS = 4;        // scene passes per frame
+const int DIRTY_MERGE_SLACK = 4096;   // extra pixels worth saving a pass
 
-    glDisable(GL_BLEND);
-}
+// Window-space rectangle in pixels, max exclusive
+struct DirtyRect {
+    int x0, y0, x1, y1;
+};
 
-// Draw Japanese-style elevated viaduct
-void drawJapaneseViaduct(float trackY) {
-    float deckThickness = 22.0f;
-    float deckY = trackY - deckThickness;
-    float pillarTop = deckY;
-    float groundY = 0.0f;
+struct DirtyTracker {
+    bool enabled;
+    std::vector<DirtyRect> cur, paint;   // reported, and merged for drawing
+    float repainted;         // fraction of the window repainted last frame
+    double repaintSum;       // for the running average
+    int frames;
+};
 
-    // ===================== VIADUCT DECK =====================
-    drawRect(0, deckY, V_WIDTH, deckThickness,
-             0.78f, 0.78f, 0.82f, 1.0f);   // Light concrete
+DirtyTracker gDirty = { true, {}, {}, 1.0f, 0.0, 0 };
 
-    // Deck edge shadow
-    drawRect(0, deckY, V_WIDTH, 3.0f,
-             0.55f, 0.55f, 0.58f, 1.0f);
+int rectArea(const DirtyRect& r) {
+    return (r.x1 - r.x0) * (r.y1 - r.y0);
+}
 
-    // ===================== SIDE BARRIERS =====================
-    for(float x = 0; x < V_WIDTH; x += 32.0f) {
-        drawRect(x, deckY + deckThickness - 6.0f,
-                 20.0f, 4.0f,
-                 0.62f, 0.62f, 0.65f, 1.0f);
-    }
+DirtyRect rectUnion(const DirtyRect& a, const DirtyRect& b) {
+    DirtyRect r = { std::min(a.x0, b.x0), std::min(a.y0, b.y0),
+                    std::max(a.x1, b.x1), std::max(a.y1, b.y1) };
+    return r;
+}
 
-    // ===================== SUPPORT PILLARS =====================
-    for(float x = 80.0f; x < V_WIDTH; x += 160.0f) {
-        // Main pillar
-        drawRect(x - 18.0f, groundY,
-                 36.0f, pillarTop - groundY,
-                 0.70f, 0.70f, 0.74f, 1.0f);
+// Report a changed area in scene units; padded for antialiased edges
+void markDirty(float x0, float y0, float x1, float y1) {
+    float sx = gRenderW / V_WIDTH, sy = gRenderH / V_HEIGHT;
+    DirtyRect r = { std::max(0, (int)floorf(x0 * sx) - 2),
+                    std::max(0, (int)floorf(y0 * sy) - 2),
+                    std::min(gRenderW, (int)ceilf(x1 * sx) + 2),
+                    std::min(gRenderH, (int)ceilf(y1 * sy) + 2) };
+    if (r.x1 > r.x0 && r.y1 > r.y0) gDirty.cur.push_back(r);
+}
 
-        // Pillar base
-        drawRect(x - 28.0f, groundY,
-                 56.0f, 14.0f,
-                 0.55f, 0.55f, 0.58f, 1.0f);
+// Join rects until at most MAX_DIRTY_RECTS are left, always merging the
+// pair whose bounding box adds the fewest pixels; overlapping or nearly
+// adjacent rects are merged regardless to save a pass
+void mergeDirtyRects(std::vector<DirtyRect>& rects) {
+    while (rects.size() > 1) {
+        size_t bi = 0, bj = 1;
+        int best = 0x7fffffff;
+        for(size_t i = 0; i < rects.size(); i++)
+            for(size_t j = i + 1; j < rects.size(); j++) {
+                int waste = rectArea(rectUnion(rects[i], rects[j]))
+                          - rectArea(rects[i]) - rectArea(rects[j]);
+                if (waste < best) { best = waste; bi = i; bj = j; }
+            }
+        if ((int)rects.size() <= MAX_DIRTY_RECTS && best > DIRTY_MERGE_SLACK)
+            break;
+        rects[bi] = rectUnion(rects[bi], rects[bj]);
+        rects.erase(rects.begin() + bj);
+    }
+}
 
-        // Top cap
-        drawRect(x - 26.0f, pillarTop - 6.0f,
-                 52.0f, 6.0f,
-                 0.60f, 0.60f, 0.63f, 1.0f);
+// True when the scene is rendered at a different size than it is shown
+bool sceneResampled() {
+    return gRenderW != gViewW || gRenderH != gViewH;
+}
+
+// Merge the rects reported for this frame and bind the scene target, which
+// is also used to resample the scene when gRenderScale is not 1 and
+// as the bloom source.
+// Returns how many scene passes display() has to draw; 1 pass drawn
+// straight to the window when neither needs the target.
+int beginDirtyFrame() {
+    gDirty.paint.clear();
+    gDirty.repainted = 1.0f;
+    if (!gHasFramebuffers ||
+        !(gDirty.enabled || sceneResampled() || bloomActive())) return 1;
+    // Supersampled frames are box-filtered down through the mip chain
+    GLenum minFilter = GL_NEAREST, magFilter = GL_NEAREST;
+    if (gRenderH > gViewH) minFilter = GL_LINEAR_MIPMAP_LINEAR;
+    else if (gRenderH < gViewH) minFilter = magFilter = GL_LINEAR;
+    if (!allocLayerTarget(gSceneLayer, 1, minFilter, magFilter)) {
+        gDirty.enabled = false;
+        return 1;
     }
 
-    // ===================== SHADOW UNDER DECK =====================
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    drawRect(0, deckY - 6.0f, V_WIDTH, 6.0f,
-             0.0f, 0.0f, 0.0f, 0.18f);
-    glDisable(GL_BLEND);
+    if (gDirty.enabled && gSceneLayer.valid) {
+        gDirty.paint = gDirty.cur;
+        mergeDirtyRects(gDirty.paint);
+        int area = 0;
+        for(size_t i = 0; i < gDirty.paint.size(); i++)
+            area += rectArea(gDirty.paint[i]);
+        gDirty.repainted = (float)area / ((float)gRenderW * gRenderH);
+    } else {
+        DirtyRect all = { 0, 0, gRenderW, gRenderH };
+        gDirty.paint.push_back(all);
+    }
+    gDirty.repaintSum += gDirty.repainted;
+    gDirty.frames++;
+
+    batchBarrier();
+    gSceneFbo = gSceneLayer.fbo;
+    glBindFramebuffer(GL_FRAMEBUFFER, gSceneFbo);
+    setSceneViewport();
+    return (int)gDirty.paint.size();
 }
 
-// Draw animated water reflections
-void drawAnimatedWater(float waterTopY) {
-    // Base water color
-    drawRect(0, 0, V_WIDTH, waterTopY,
-             0.06f, 0.18f, 0.32f, 1.0f);
+// Clip scene drawing to one dirty rect and clear it
+void beginDirtyPass(int i) {
+    if (gSceneFbo == 0) return;
+    batchBarrier();
+    const DirtyRect& r = gDirty.paint[i];
+    glScissor(r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0);
+    glEnable(GL_SCISSOR_TEST);
+    gSceneScissor = true;
+    glClear(GL_COLOR_BUFFER_BIT);
+}
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+// Put the updated scene on the screen, resampled to the viewport,
+// with bloom added on top
+void endDirtyFrame() {
+    if (gSceneFbo == 0) return;
+    batchBarrier();
+    glDisable(GL_SCISSOR_TEST);
+    gSceneScissor = false;
+    gSceneFbo = 0;
+    gSceneLayer.valid = true;
+    if (gRenderH > gViewH) {
+        stateBindTexture(gSceneLayer.tex);
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
+    int bloom = bloomActive() ? buildBloom(gSceneLayer) : -1;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    setSceneViewport();
+    drawTexturedRect(0, 0, V_WIDTH, V_HEIGHT, gSceneLayer.tex, BLEND_OFF);
+    if (bloom >= 0) {
+        // Only the queued quad reads it from here on, and nothing else
+        // borrows a transient target before the frame is submitted
+        const TransientTarget& B = gTransients[bloom];
+        float k = gBloom.intensity;
+        float u = (float)B.w / B.rt.w, v = (float)B.h / B.rt.h;
+        batchBegin(BATCH_TRIANGLES, B.rt.tex, BLEND_PREMULTIPLIED);
+        batchVertexUV(0.0f,    0.0f,     0.0f, 0.0f, k, k, k, 1.0f);
+        batchVertexUV(V_WIDTH, 0.0f,     u,    0.0f, k, k, k, 1.0f);
+        batchVertexUV(V_WIDTH, V_HEIGHT, u,    v,    k, k, k, 1.0f);
+        batchVertexUV(0.0f,    0.0f,     0.0f, 0.0f, k, k, k, 1.0f);
+        batchVertexUV(V_WIDTH, V_HEIGHT, u,    v,    k, k, k, 1.0f);
+        batchVertexUV(0.0f,    V_HEIGHT, 0.0f, v,    k, k, k, 1.0f);
+        releaseTarget(bloom);
+    }
+}
 
-    // Moving horizontal reflection streaks
-    for(int i = 0; i < 40; i++) {
-        float y = fmodf(i * 14.0f + waterTime * 22.0f, waterTopY);
-        float x = fmodf(i * 63.0f + waterTime * 40.0f, V_WIDTH);
-        float w = 60.0f + 40.0f * sinf(waterTime + i);
-        float a = 0.04f + 0.03f * sinf(waterTime * 1.4f + i);
+// ==================== FRAME CAPTURE ====================
+
+// --capture <file> writes every presented frame as a binary PPM to a
+// stream ("-" for stdout, e.g. piped into ffmpeg -f image2pipe). Frames
+// are read into two alternating pixel-pack buffers: frame N is queued
+// for readback while frame N-1, read a whole frame earlier, is mapped
+// and handed to a writer thread. The GL thread only waits when the
+// writer or the GPU falls more than a frame behind.
+struct FrameCapture {
+    FILE* out;
+    GLuint pbo[2];
+    size_t pboBytes[2];
+    GLsync fence[2];
+    int w[2], h[2];        // size of the readback pending in each buffer
+    bool pending[2];
+    int next;              // buffer the next frame is read into
+    int mapped;            // buffer the writer is using (-1 none)
+    std::vector<unsigned char> client;  // no-PBO fallback (GL < 3.3)
+
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable wake, done;
+    const unsigned char* job;           // pixels for the writer, RGBA bottom-up
+    int jobW, jobH;
+    bool quit;
+
+    int frames;            // frames written
+    int stalls;            // times the GL thread had to wait
+};
+
+FrameCapture gCapture;
+
+// Writer thread: flip RGBA rows into RGB PPM frames
+void captureWriter() {
+    std::vector<unsigned char> row;
+    std::unique_lock<std::mutex> lk(gCapture.lock);
+    for(;;) {
+        while (!gCapture.job && !gCapture.quit) gCapture.wake.wait(lk);
+        if (!gCapture.job) return;
+        const unsigned char* px = gCapture.job;
+        int w = gCapture.jobW, h = gCapture.jobH;
+        lk.unlock();
+
+        row.resize(w * 3);
+        fprintf(gCapture.out, "P6\n%d %d\n255\n", w, h);
+        for(int y = h - 1; y >= 0; y--) {
+            const unsigned char* src = px + (size_t)y * w * 4;
+            for(int x = 0; x < w; x++) {
+                row[x * 3 + 0] = src[x * 4 + 0];
+                row[x * 3 + 1] = src[x * 4 + 1];
+                row[x * 3 + 2] = src[x * 4 + 2];
+            }
+            fwrite(&row[0], 1, row.size(), gCapture.out);
+        }
+        fflush(gCapture.out);
 
-        drawRect(x, y, w, 2.0f,
-                 0.95f, 0.75f, 0.45f, a);
+        lk.lock();
+        gCapture.job = NULL;
+        gCapture.frames++;
+        gCapture.done.notify_all();
     }
+}
 
-    // Soft vertical shimmer near bridge
-    for(int i = 0; i < 12; i++) {
-        float x = i * (V_WIDTH / 12.0f) + sinf(waterTime + i) * 8.0f;
-        drawRect(x, waterTopY - 12.0f,
-                 6.0f, 12.0f,
-                 0.9f, 0.7f, 0.4f, 0.08f);
+// Start capturing to a file; needs a current context
+bool beginCapture(const char* path) {
+    gCapture.out = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (!gCapture.out) {
+        fprintf(stderr, "cannot open capture file %s\n", path);
+        return false;
     }
+    gCapture.mapped = -1;
+    if (gHasGL33) glGenBuffers(2, gCapture.pbo);
+    gCapture.writer = std::thread(captureWriter);
+    return true;
+}
 
-    glDisable(GL_BLEND);
+// Block until the writer is idle, then release its buffer
+void captureWaitWriter() {
+    {
+        std::unique_lock<std::mutex> lk(gCapture.lock);
+        if (gCapture.job) gCapture.stalls++;
+        while (gCapture.job) gCapture.done.wait(lk);
+    }
+    if (gCapture.mapped >= 0) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, gCapture.pbo[gCapture.mapped]);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        gCapture.mapped = -1;
+    }
 }
 
-// Draw three DDA lamp posts
-void drawThreeDDALamps() {
-    float groundY = 120.0f;  // Bridge / road height
+// Give the writer a frame
+void captureSubmit(const unsigned char* px, int w, int h) {
+    std::lock_guard<std::mutex> lk(gCapture.lock);
+    gCapture.job = px;
+    gCapture.jobW = w;
+    gCapture.jobH = h;
+    gCapture.wake.notify_one();
+}
 
-    drawDDALampPost(180.0f, groundY);
-    drawDDALampPost(420.0f, groundY);
-    drawDDALampPost(660.0f, groundY);
+// Map a finished readback and pass it to the writer
+void captureHandOff(int buf) {
+    GLsync fence = gCapture.fence[buf];
+    if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        gCapture.stalls++;
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                1000000000u) == GL_TIMEOUT_EXPIRED) {}
+    }
+    glDeleteSync(fence);
+    gCapture.fence[buf] = 0;
+    gCapture.pending[buf] = false;
+
+    size_t bytes = (size_t)gCapture.w[buf] * gCapture.h[buf] * 4;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, gCapture.pbo[buf]);
+    void* px = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (!px) return;
+    gCapture.mapped = buf;
+    captureSubmit((const unsigned char*)px, gCapture.w[buf], gCapture.h[buf]);
 }
 
-// Draw speed boat
-void drawSpeedBoat() {
-    float waterY = 65.0f;
+// Capture the frame just drawn (call before swapping buffers)
+void captureFrame() {
+    if (!gCapture.out) return;
+    if (gHeadless) {
+        // The next frame is drawn over gSoft, so hand over a copy
+        captureWaitWriter();
+        gCapture.client = gSoft.pixels;
+        captureSubmit(&gCapture.client[0], gSoft.w, gSoft.h);
+        return;
+    }
+    int w = gWindowW, h = gWindowH;
+    size_t bytes = (size_t)w * h * 4;
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+    if (!gHasGL33) {
+        // Synchronous fallback
+        captureWaitWriter();
+        gCapture.client.resize(bytes);
+        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, &gCapture.client[0]);
+        captureSubmit(&gCapture.client[0], w, h);
+        return;
+    }
 
-    glPushMatrix();
-    glTranslatef(boatPos, waterY, 0);
+    int cur = gCapture.next, prev = 1 - cur;
+    captureWaitWriter();   // it may still hold `cur` from two frames ago
 
-    // Slight scale up
-    glScalef(1.4f, 1.4f, 1.0f);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, gCapture.pbo[cur]);
+    if (gCapture.pboBytes[cur] != bytes) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+        gCapture.pboBytes[cur] = bytes;
+    }
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    gCapture.fence[cur] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    gCapture.w[cur] = w;
+    gCapture.h[cur] = h;
+    gCapture.pending[cur] = true;
+
+    if (gCapture.pending[prev]) captureHandOff(prev);
+    gCapture.next = prev;
+}
 
-    // ================= MAIN HULL (ANGLED) =================
-    glBegin(GL_POLYGON);
-        glColor3f(0.12f, 0.12f, 0.15f);   // Dark steel gray
-        glVertex2f(0, 2);     // Rear bottom
-        glVertex2f(10, 0);
-        glVertex2f(95, 0);    // Bottom mid
-        glVertex2f(120, 9);   // Sharp bow
-        glVertex2f(95, 18);   // Upper hull
-        glVertex2f(12, 18);
-        glVertex2f(0, 14);    // Rear top
-    glEnd();
+// Write out the frames still in flight and stop the writer
+void endCapture() {
+    if (!gCapture.out) return;
+    if (gHasGL33) {
+        int last = gCapture.next, first = 1 - last;   // oldest first
+        for(int i = 0; i < 2; i++) {
+            int buf = i == 0 ? first : last;
+            if (!gCapture.pending[buf]) continue;
+            captureWaitWriter();
+            captureHandOff(buf);
+        }
+    }
+    captureWaitWriter();
+    {
+        std::lock_guard<std::mutex> lk(gCapture.lock);
+        gCapture.quit = true;
+        gCapture.wake.notify_one();
+    }
+    gCapture.writer.join();
+    if (gCapture.out != stdout) fclose(gCapture.out);
+    gCapture.out = NULL;
+    fprintf(stderr, "captured %d frames (%d stalls)\n",
+            gCapture.frames, gCapture.stalls);
+}
 
-    // ================= HULL TOP EDGE =================
-    glBegin(GL_LINES);
-        glColor3f(0.25f, 0.25f, 0.28f);
-        glVertex2f(12, 18);
-        glVertex2f(95, 18);
-    glEnd();
+// ==================== RIVER REFLECTION ====================
+
+// The city mirrored in the river, built from the cached skyline and
+// viaduct layers rather than by drawing the scene a second time: each
+// layer is drawn once more as a full-width strip of thin bands, flipped
+// at the waterline and squashed, every band shifted sideways by a ripple
+// that moves with waterTime. The cost does not depend on what is in the
+// layers. Without the layer cache (or headless) there is nothing to
+// sample and the buildings are not mirrored.
+//
+// The lamps, signals and train are drawn straight into the scene, so
+// they are mirrored directly with the same flip, ripple and fade: each
+// light as a radial glow stretched down the water, the train as its car
+// bodies and windows. That is a fixed handful of quads, drawn with or
+// without the layer cache.
+const float RIVER_TOP_Y = 120.0f;
+const StaticLayer REFLECTED_LAYERS[2] = { LAYER_SKYLINES, LAYER_VIADUCT };
+const int REFLECTION_BANDS = 30;
+const float REFLECTION_SQUASH = 1.5f;   // scene units mirrored per river unit
+const float REFLECTION_ALPHA = 0.45f;   // at the waterline, fading with depth
+const float REFLECTION_BAND_DEPTH = 4.0f;   // river units per mirrored band
+
+// Depth below the waterline at which a scene height is mirrored
+float reflectionDepth(float y) {
+    return (y - RIVER_TOP_Y) / REFLECTION_SQUASH;
+}
 
-    // ================= BLACK STRIPE =================
-    drawRect(14, 7, 70, 3,
-             0.0f, 0.0f, 0.0f);
+// Sideways ripple of the reflection at a depth, in scene units
+float reflectionRipple(float d) {
+    return sinf(d * 0.35f + waterTime * 2.2f) * (1.0f + d * 0.03f);
+}
 
-    // ================= CABIN (SLOPED) =================
-    glBegin(GL_POLYGON);
-        glColor3f(0.88f, 0.88f, 0.90f);
-        glVertex2f(30, 18);
-        glVertex2f(70, 18);
-        glVertex2f(60, 34);
-        glVertex2f(34, 34);
-    glEnd();
+float reflectionAlpha(float d) {
+    return REFLECTION_ALPHA * (1.0f - 0.7f * d / RIVER_TOP_Y);
+}
 
-    // ================= FRONT WINDOW =================
-    glBegin(GL_POLYGON);
-        glColor3f(0.30f, 0.55f, 0.75f);
-        glVertex2f(38, 22);
-        glVertex2f(56, 22);
-        glVertex2f(50, 30);
-        glVertex2f(40, 30);
-    glEnd();
+// Mirror a rect above the waterline, in bands so it ripples
+void drawReflectedRect(float x0, float y0, float x1, float y1,
+                       float r, float g, float b) {
+    float d0 = reflectionDepth(y0), d1 = reflectionDepth(y1);
+    int bands = std::max(1, (int)ceilf((d1 - d0) / REFLECTION_BAND_DEPTH));
+    batchBegin(BATCH_TRIANGLES);
+    for(int i = 0; i < bands; i++) {
+        float da = d0 + (d1 - d0) * i / bands;
+        float db = d0 + (d1 - d0) * (i + 1) / bands;
+        float sa = reflectionRipple(da), sb = reflectionRipple(db);
+        float aa = reflectionAlpha(da), ab = reflectionAlpha(db);
+        float ya = RIVER_TOP_Y - da, yb = RIVER_TOP_Y - db;
+        batchVertex(x0 + sa, ya, r, g, b, aa);
+        batchVertex(x1 + sa, ya, r, g, b, aa);
+        batchVertex(x1 + sb, yb, r, g, b, ab);
+        batchVertex(x0 + sa, ya, r, g, b, aa);
+        batchVertex(x1 + sb, yb, r, g, b, ab);
+        batchVertex(x0 + sb, yb, r, g, b, ab);
+    }
+}
 
-    // ================= SIDE WINDOW =================
-    drawRect(58, 22, 10, 6,
-             0.30f, 0.55f, 0.75f);
+// A light's streak on the water: the white signal disc and glow,
+// tinted and stretched downwards, kept below the waterline
+void drawReflectedLight(float x, float y, float radius,
+                        float r, float g, float b) {
+    const GlowSprite& s = gGlows[GLOW_SIGNAL];
+    float d = reflectionDepth(y);
+    float stretch = std::min(radius * 3.0f, d);
+    float a = 0.8f * reflectionAlpha(d) / REFLECTION_ALPHA;
+    drawGlowSprite(GLOW_SIGNAL, x + reflectionRipple(d), RIVER_TOP_Y - d,
+                   radius / s.extentX, stretch / s.extentY, r, g, b, a);
+}
 
-    glEnd();
-    glDisable(GL_BLEND);
+void drawLayerReflections() {
+    for(int l = 0; l < 2; l++) {
+        const CachedLayer& L = gLayers[REFLECTED_LAYERS[l]];
+        if (!L.valid) continue;
+        batchBegin(BATCH_TRIANGLES, L.tex, BLEND_PREMULTIPLIED);
+        float y[2], u[2], v[2], a[2];
+        for(int i = 0; i < REFLECTION_BANDS; i++) {
+            for(int k = 0; k < 2; k++) {
+                float d = RIVER_TOP_Y * (i + k) / REFLECTION_BANDS;  // depth
+                y[k] = RIVER_TOP_Y - d;
+                v[k] = (RIVER_TOP_Y + d * REFLECTION_SQUASH) / V_HEIGHT;
+                u[k] = reflectionRipple(d) / V_WIDTH;
+                a[k] = reflectionAlpha(d);
+            }
+            batchVertexUV(0.0f,    y[0], u[0],        v[0], 0.7f * a[0], 0.8f * a[0], a[0], a[0]);
+            batchVertexUV(V_WIDTH, y[0], u[0] + 1.0f, v[0], 0.7f * a[0], 0.8f * a[0], a[0], a[0]);
+            batchVertexUV(V_WIDTH, y[1], u[1] + 1.0f, v[1], 0.7f * a[1], 0.8f * a[1], a[1], a[1]);
+            batchVertexUV(0.0f,    y[0], u[0],        v[0], 0.7f * a[0], 0.8f * a[0], a[0], a[0]);
+            batchVertexUV(V_WIDTH, y[1], u[1] + 1.0f, v[1], 0.7f * a[1], 0.8f * a[1], a[1], a[1]);
+            batchVertexUV(0.0f,    y[1], u[1],        v[1], 0.7f * a[1], 0.8f * a[1], a[1], a[1]);
+        }
+    }
+}
 
-    glPopMatrix();
+// Train cars and windows as drawn by drawTrainBodyShape/drawTrainWindows,
+// and the lamps and lit signals
+void drawSceneReflections() {
+    float trainY = 162.0f;   // drawTrain's track height less the wheels
+    float carW = 140.0f, carH = 64.0f;
+    setBlend(true);
+    for(int car = 0; car < 4; ++car) {
+        float x = trainPos - car * (carW + 8.0f);
+        if (x + carW < -8.0f || x > V_WIDTH + 8.0f) continue;
+        drawReflectedRect(x, trainY, x + carW, trainY + carH,   // tinted body
+                          0.95f * 0.7f, 0.72f * 0.8f, 0.18f);
+        for(float wx = 12.0f; wx < carW - 12.0f; wx += 34.0f)
+            drawReflectedRect(x + wx, trainY + 27.0f,
+                              x + wx + 24.0f, trainY + 47.0f, 1.0f, 0.95f, 0.5f);
+    }
+    drawReflectedLight(trainPos + 21.0f, trainY + 27.0f, 20.0f, 1.0f, 0.95f, 0.6f);
+
+    float lampY = LAMP_GROUND_Y + LAMP_POLE_HEIGHT - LAMP_GLOW_DROP;
+    for(int i = 0; i < 3; i++)
+        drawReflectedLight(LAMP_X[i] + LAMP_ARM_LENGTH, lampY, 24.0f,
+                           1.0f, 0.86f, 0.55f);
+    for(int i = 0; i < 2; i++) {
+        const float* L = SIGNAL_LIGHTS[signalLamp(SIGNAL_PHASE[i])];
+        drawReflectedLight(SIGNAL_X[i], SIGNAL_BRIDGE_Y + L[0], 16.0f,
+                           L[1], L[2], L[3]);
+    }
+    setBlend(false);
 }
 
-// Draw a bat
-void drawBat(float cx, float cy, float scale) {
-    glPushMatrix();
-    glTranslatef(cx, cy, 0);
-    glScalef(scale, scale, 1.0f);
+void drawRiverReflection() {
+    if (gLayerCacheEnabled && gHasFramebuffers) drawLayerReflections();
+    drawSceneReflections();
+}
 
-    glColor3f(0.05f, 0.05f, 0.07f); // Dark bat color
+// ==================== RENDER GRAPH ====================
+
+// The frame is a list of passes in painter's order. Each pass declares
+// the values it reads, where its output goes and how often it has to
+// update:
+//   PASS_STATIC      only when its inputs change
+//   PASS_EVERY_N     every interval frames, or when its inputs change
+//   PASS_EVERY_FRAME every frame (per-frame random flicker)
+// A pass that updates reports the area it covered before and the one it
+// covers now as dirty, or only the parts that changed if it changes in
+// place; passes that did not update keep their pixels in the cached
+// scene and their layer targets. Bounds must hold everything a pass
+// draws, since scene rects outside them skip the pass. Random numbers
+// are seeded per pass from its inputs and update epoch, so a pass
+// redrawn inside someone else's dirty rect reproduces exactly what it
+// drew before.
+
+enum PassRate {
+    PASS_STATIC,
+    PASS_EVERY_N,
+    PASS_EVERY_FRAME
+};
+
+// Outputs besides the StaticLayer targets
+const int OUT_SCENE  = LAYER_COUNT;       // the scene target, see DIRTY REGIONS
+const int OUT_SCREEN = LAYER_COUNT + 1;   // on top of the composited frame
+
+struct RenderPass {
+    const char* name;
+    int layer;               // sort layer
+    void (*draw)();
+    int output;              // a StaticLayer, OUT_SCENE or OUT_SCREEN
+    PassRate rate;
+    int interval;            // frames per update for PASS_EVERY_N
+    unsigned (*inputs)();    // hash of the values it reads, or NULL
+    void (*bounds)();        // marks the area it covers, NULL for everything
+    void (*damage)();        // marks what changed in place, NULL: old and new bounds
+};
+
+// Scheduler state, one per entry of gPasses
+struct PassState {
+    unsigned key;            // inputs and epoch of the last update
+    bool updated;            // key is valid
+    std::vector<DirtyRect> area;   // what the last update covered
+};
+
+struct RenderGraph {
+    unsigned seed;           // base of the per-pass random seeds
+    unsigned frame;
+    int updated, run, culled;   // last frame's pass counts
+};
+
+RenderGraph gGraph = { 0, 0, 0, 0, 0 };
+
+//    baseY, minW, maxW, minH, maxH, seed, darkness
+const float SKYLINE_FAR[7]  = { 240.0f, 26.0f, 70.0f, 160.0f, 220.0f, 101.0f, 0.42f };
+const float SKYLINE_NEAR[7] = { 160.0f, 36.0f, 88.0f, 140.0f, 220.0f, 142.0f, 0.28f };
+const float VIADUCT_TRACK_Y = 170.0f;
+
+// Pass bodies that are more than one call
+void drawCloudsPass() {
+    drawCloud(220.0f, V_HEIGHT * 0.62f, 1.05f, 0.75f);
+    drawCloud(420.0f, V_HEIGHT * 0.66f, 0.82f, 0.55f);
+    drawCloud(620.0f, V_HEIGHT * 0.58f, 0.9f, 0.60f);
+}
 
-    // Left wing
-    glBegin(GL_TRIANGLES);
-        glVertex2f(0, 0);
-        glVertex2f(-18, 8);
-        glVertex2f(-30, 0);
-    glEnd();
+void drawSunCloudsPass() {
+    drawSunFlares();
+    drawCloudLayer(V_HEIGHT * 0.62f, 11, 8, 0.42f, 0.8f, 1.1f);
+    drawCloudLayer(V_HEIGHT * 0.50f, 23, 10, 0.30f, 0.6f, 1.2f);
+}
 
-    // Right wing
-    glBegin(GL_TRIANGLES);
-        glVertex2f(0, 0);
-        glVertex2f(18, 8);
-        glVertex2f(30, 0);
-    glEnd();
+void drawSkylinesPass() {
+    drawSkylineLayer(SKYLINE_FAR);
+    drawSkylineLayer(SKYLINE_NEAR);
+}
 
-    // Body
-    glBegin(GL_TRIANGLES);
-        glVertex2f(-4, 0);
-        glVertex2f(4, 0);
-        glVertex2f(0, -10);
-    glEnd();
+void drawWaterPass()   { drawAnimatedWater(RIVER_TOP_Y); }
 
-    glPopMatrix();
+void drawPowerPass() {
+    drawPolesAndWires();
+    drawPowerPillarsAndWires();
 }
 
-// Draw multiple bats in sky
-void drawBatsInSky() {
-    drawBat(120, 520, 0.7f);
-    drawBat(160, 540, 0.5f);
-    drawBat(210, 515, 0.6f);
+void drawViaductPass() { drawJapaneseViaduct(VIADUCT_TRACK_Y); }
+void drawMoonPass()    { drawMoon(V_WIDTH * 0.78f, V_HEIGHT * 0.78f, 22.0f); }
 
-    drawBat(520, 560, 0.8f);
-    drawBat(560, 540, 0.6f);
+// Pass inputs
+unsigned skyInputs() {
+    return hashParams(&gSkyGradient.stops[0].pos, gSkyGradient.count * 4);
+}
 
-    drawBat(680, 510, 0.7f);
+unsigned skylineInputs() {
+    unsigned h = hashParams(SKYLINE_NEAR, 7, hashParams(SKYLINE_FAR, 7));
+    return (h ^ gImpostors.version) * 16777619u;
 }
 
-// ==================== DISPLAY / UPDATE ====================
+unsigned viaductInputs() { return hashParams(&VIADUCT_TRACK_Y, 1); }
+unsigned waterInputs()   { return hashParams(&waterTime, 1); }
+unsigned boatInputs()    { return hashParams(&boatPos, 1); }
+unsigned trainInputs()   { return hashParams(&trainPos, 1); }
 
-// Main display function
-void display() {
-    glClear(GL_COLOR_BUFFER_BIT);
+// The ripple, and the layers being there to sample
+unsigned signalInputs() {
+    float lamps[2] = { (float)signalLamp(SIGNAL_PHASE[0]),
+                       (float)signalLamp(SIGNAL_PHASE[1]) };
+    return hashParams(lamps, 2);
+}
 
-    // 1) Sky + sun + clouds + bands
-    drawSky();
-    drawBatsInSky();
-    drawCloud(220.0f, V_HEIGHT * 0.62f, 1.05f, 0.75f);
-    drawCloud(420.0f, V_HEIGHT * 0.66f, 0.82f, 0.55f);
-    drawCloud(620.0f, V_HEIGHT * 0.58f, 0.9f, 0.60f);
-    drawHalftoneBand();
-    drawSunAndFlares();
-    drawCloudLayer(V_HEIGHT * 0.62f, 11, 8, 0.42f, 0.8f, 1.1f);
-    drawCloudLayer(V_HEIGHT * 0.50f, 23, 10, 0.30f, 0.6f, 1.2f);
+unsigned reflectionInputs() {
+    unsigned h = waterInputs();
+    for(int l = 0; l < 2; l++) {
+        const CachedLayer& L = gLayers[REFLECTED_LAYERS[l]];
+        h = (h ^ (L.valid ? L.key : 0u)) * 16777619u;
+    }
+    h = (h ^ trainInputs()) * 16777619u;
+    return (h ^ signalInputs()) * 16777619u;
+}
 
-    // 2) Distant & mid skylines (STABLE)
-    drawSkylineLayer(240.0f, 26.0f, 70.0f, 160.0f, 220.0f, 101, 0.42f);
-    drawSkylineLayer(160.0f, 36.0f, 88.0f, 140.0f, 220.0f, 142, 0.28f);
+// Pass bounds, in scene units
+void riverBounds() { markDirty(0.0f, 0.0f, V_WIDTH, RIVER_TOP_Y); }
 
-    // 3) Bridge base
-    drawBridgeAndWater();
+void boatBounds() {
+    markDirty(boatPos, 65.0f, boatPos + 120.0f * 1.4f, 65.0f + 34.0f * 1.4f);
+}
 
-    // 4) Animated water (draw FIRST)
-    float bridgeY = 120.0f;
-    drawAnimatedWater(bridgeY);
+// Train cars and wheels, and the headlight glow
+void trainBounds() {
+    float trainY = VIADUCT_TRACK_Y - 8.0f;
+    markDirty(trainPos - 3 * 148.0f, trainY - 20.0f,
+              trainPos + 140.0f, trainY + 64.0f);
+    markDirty(trainPos + 36.0f - 60.0f, trainY + 188.0f - 60.0f,
+              trainPos + 36.0f + 60.0f, trainY + 188.0f + 60.0f);
+}
 
-    // 5) Speedboat (draw AFTER water so it's visible)
-    drawSpeedBoat();
+void halftoneBounds() {
+    float bandY = V_HEIGHT * 0.38f;
+    markDirty(0.0f, bandY - 18.0f, V_WIDTH + 2.0f, bandY + 18.0f);
+}
 
-    // 6) Poles & power infrastructure
-    drawPolesAndWires();
-    drawPowerPillarsAndWires();
+// Windows that switched since the last frame
+void skylineDamage() {
+    std::vector<float>& d = gImpostors.damage;
+    for(size_t i = 0; i + 3 < d.size(); i += 4)
+        markDirty(d[i], d[i + 1], d[i + 2], d[i + 3]);
+    d.clear();
+}
 
-    // 7) Traffic signals
-    drawTrafficSignals();
+// Whole signals, pole included
+void signalBounds() {
+    float glow = gGlows[GLOW_SIGNAL].extentX;
+    for(int i = 0; i < 2; i++)
+        markDirty(SIGNAL_X[i] - glow, SIGNAL_BRIDGE_Y + 72.0f,
+                  SIGNAL_X[i] + glow, SIGNAL_BRIDGE_Y + SIGNAL_RED_Y + glow);
+}
 
-    // 8) Lamp posts (DDA)
-    drawThreeDDALamps();
+const RenderPass gPasses[] = {
+    // name          layer draw                   output            rate              N  inputs            bounds          damage
+    { "sky",         1,    drawSky,               LAYER_SKY,        PASS_STATIC,      0, skyInputs,        NULL,           NULL },
+    { "bats",        1,    drawBatsInSky,         OUT_SCENE,        PASS_STATIC,      0, NULL,             NULL,           NULL },
+    { "clouds",      1,    drawCloudsPass,        LAYER_CLOUDS,     PASS_STATIC,      0, NULL,             NULL,           NULL },
+    { "halftone",    1,    drawHalftoneBand,      OUT_SCENE,        PASS_EVERY_N,     2, NULL,             halftoneBounds, NULL },
+    { "sun",         1,    drawSun,               OUT_SCENE,        PASS_STATIC,      0, NULL,             NULL,           NULL },
+    { "sun clouds",  1,    drawSunCloudsPass,     LAYER_SUN_CLOUDS, PASS_STATIC,      0, NULL,             NULL,           NULL },
+    { "skylines",    2,    drawSkylinesPass,      LAYER_SKYLINES,   PASS_STATIC,      0, skylineInputs,    NULL,           skylineDamage },
+    { "bridge",      3,    drawBridgeAndWater,    OUT_SCENE,        PASS_STATIC,      0, NULL,             NULL,           NULL },
+    { "reflections", 3,    drawBridgeReflections, OUT_SCENE,        PASS_EVERY_FRAME, 0, NULL,             riverBounds,    NULL },
+    { "water",       4,    drawWaterPass,         OUT_SCENE,        PASS_STATIC,      0, waterInputs,      riverBounds,    NULL },
+    { "reflection",  4,    drawRiverReflection,   OUT_SCENE,        PASS_STATIC,      0, reflectionInputs, riverBounds,    NULL },
+    { "boat",        5,    drawSpeedBoat,         OUT_SCENE,        PASS_STATIC,      0, boatInputs,       boatBounds,     NULL },
+    { "power",       6,    drawPowerPass,         LAYER_POWER,      PASS_STATIC,      0, NULL,             NULL,           NULL },
+    { "signals",     7,    drawTrafficSignals,    OUT_SCENE,        PASS_STATIC,      0, signalInputs,     signalBounds,   NULL },
+    { "lamps",       8,    drawThreeDDALamps,     OUT_SCENE,        PASS_STATIC,      0, NULL,             NULL,           NULL },
+    { "viaduct",     9,    drawViaductPass,       LAYER_VIADUCT,    PASS_STATIC,      0, viaductInputs,    NULL,           NULL },
+    { "train",       10,   drawTrain,             OUT_SCENE,        PASS_EVERY_FRAME, 0, trainInputs,      trainBounds,    NULL },
+    { "moon",        11,   drawMoonPass,          OUT_SCENE,        PASS_STATIC,      0, NULL,             NULL,           NULL },
+    { "lights",      12,   drawDistantLights,     OUT_SCREEN,       PASS_EVERY_FRAME, 0, NULL,             NULL,           NULL },
+};
+
+const int PASS_COUNT = sizeof(gPasses) / sizeof(gPasses[0]);
+PassState gPassStates[PASS_COUNT];
+
+unsigned passEpoch(const RenderPass& p) {
+    if (p.rate == PASS_EVERY_FRAME) return gGraph.frame;
+    if (p.rate == PASS_EVERY_N) return gGraph.frame / p.interval;
+    return 0;
+}
 
-    // 9) Japanese elevated viaduct
-    float trackY = 170.0f;
-    drawJapaneseViaduct(trackY);
+// Whether the pass can touch the scene rect being redrawn
+bool passInRect(int pass, int rect) {
+    if (gSceneFbo == 0 || !gPasses[pass].bounds) return true;
+    const std::vector<DirtyRect>& area = gPassStates[pass].area;
+    const DirtyRect& r = gDirty.paint[rect];
+    for(size_t i = 0; i < area.size(); i++) {
+        const DirtyRect& a = area[i];
+        if (a.x0 < r.x1 && r.x0 < a.x1 && a.y0 < r.y1 && r.y0 < a.y1)
+            return true;
+    }
+    return false;
+}
 
-    // 10) Train (ONLY moving object on land)
-    drawTrain();
+void runPass(int i) {
+    const RenderPass& p = gPasses[i];
+    unsigned key = gPassStates[i].key;
+    setSortLayer(p.layer);
+    srand(gGraph.seed ^ key ^ ((unsigned)i * 2654435761u));
+    gGraph.run++;
+    if (p.output < LAYER_COUNT) {
+        StaticLayer id = (StaticLayer)p.output;
+        if (beginCachedLayer(id, key)) p.draw();
+        endCachedLayer(id);
+    } else {
+        p.draw();
+    }
+}
 
-    // 11) Moon
-    drawMoon(V_WIDTH * 0.78f, V_HEIGHT * 0.78f, 22.0f);
+// Draw one frame: find the passes due for an update and report their
+// old and new areas, redraw the scene rects the dirty tracker asks for
+// with only the passes that reach into them, then the screen overlay
+void runRenderGraph() {
+    gGraph.frame++;
+    gGraph.updated = gGraph.run = gGraph.culled = 0;
+    gTransientRequests = 0;
+
+    // A scene that is redrawn in full takes every pass's current state
+    bool all = !gSceneLayer.valid;
+    gDirty.cur.clear();
+    for(int i = 0; i < PASS_COUNT; i++) {
+        const RenderPass& p = gPasses[i];
+        PassState& st = gPassStates[i];
+        unsigned key = p.inputs ? p.inputs() : 2166136261u;
+        key = (key ^ passEpoch(p)) * 16777619u;
+        if (st.updated && key == st.key && !all) continue;
+        bool moved = all || !st.updated || !p.damage;
+        st.key = key;
+        st.updated = true;
+        gGraph.updated++;
+        if (p.output == OUT_SCREEN) continue;
+        if (p.damage) p.damage();
+        if (!moved) continue;
+        gDirty.cur.insert(gDirty.cur.end(), st.area.begin(), st.area.end());
+        size_t first = gDirty.cur.size();
+        if (p.bounds) p.bounds();
+        else markDirty(0.0f, 0.0f, V_WIDTH, V_HEIGHT);
+        st.area.assign(gDirty.cur.begin() + first, gDirty.cur.end());
+    }
 
-    // 12) Final city lights
-    drawDistantLights();
+    int rects = beginDirtyFrame();
+    for(int r = 0; r < rects; r++) {
+        beginDirtyPass(r);
+        for(int i = 0; i < PASS_COUNT; i++) {
+            if (gPasses[i].output == OUT_SCREEN) continue;
+            if (passInRect(i, r)) runPass(i);
+            else gGraph.culled++;
+        }
+    }
+    endDirtyFrame();
 
-    glutSwapBuffers();
+    for(int i = 0; i < PASS_COUNT; i++)
+        if (gPasses[i].output == OUT_SCREEN) runPass(i);
 }
 
-// Update animation states
-void update(int) {
+// ==================== DISPLAY / UPDATE ====================
+
+// Main display function
+void display() {
+    if (gHeadless) softClear(0.0f, 0.0f, 0.02f, 1.0f);
+    else glClear(GL_COLOR_BUFFER_BIT);
+    batchBeginFrame();
+    runRenderGraph();
+    batchEndFrame();
+    if (gHeadless) softFlush();
+    captureFrame();
+    if (!gHeadless) glutSwapBuffers();
+}
+
+// Advance the animation by one ~60 Hz tick
+void advanceAnimation() {
     if(!paused) {
         // Advance train position to animate it across the scene
         trainPos += trainSpeed;
@@ -904,6 +4963,17 @@ void update(int) {
     }
     waterTime += 0.016f;   // ~60 FPS water movement
 
+    // Now and then somebody switches a light on or off
+    static int windowTicks = 0;
+    if (gWindowSwitching && !paused && ++windowTicks >= WINDOW_SWITCH_FRAMES) {
+        windowTicks = 0;
+        switchWindowLight();
+    }
+}
+
+// Update animation states
+void update(int) {
+    advanceAnimation();
     glutPostRedisplay();
     glutTimerFunc(16, update, 0);
 }
@@ -912,6 +4982,7 @@ void update(int) {
 void keyboard(unsigned char key, int x, int y) {
     switch(key) {
         case 27:  // ESC to exit
+            endCapture();
             exit(0);
             break;
         case ' ': // Space to pause
@@ -923,33 +4994,228 @@ void keyboard(unsigned char key, int x, int y) {
         case '-': // Decrease train speed (clamped)
             trainSpeed = std::max(0.2f, trainSpeed - 0.2f);
             break;
+        case 'i': // Toggle instanced prop rendering
+            gPropInstancing = !gPropInstancing;
+            invalidateLayerCache();
+            break;
+        case 'a': // Toggle shader-side animation
+            gAnimShaders = !gAnimShaders;
+            gSceneLayer.valid = false;
+            break;
+        case 'c': // Toggle the static layer cache
+            gLayerCacheEnabled = !gLayerCacheEnabled;
+            invalidateLayerCache();
+            break;
+        case 'd': // Toggle dirty-rect redraw
+            gDirty.enabled = !gDirty.enabled;
+            gSceneLayer.valid = false;
+            break;
+        case 'l': // Toggle reduced-resolution sky and cloud layers
+            gLowResLayers = !gLowResLayers;
+            invalidateLayerCache();
+            break;
+        case 'b': // Toggle bloom; the sprite halos stand in without it
+            gBloom.enabled = !gBloom.enabled;
+            setLightHalos(!bloomActive());
+            invalidateLayerCache();
+            break;
+        case 'h': // Toggle the per-light halos
+            setLightHalos(!gLightHalos);
+            invalidateLayerCache();
+            break;
+        case 'm': // Toggle the building impostors
+            gImpostors.enabled = !gImpostors.enabled;
+            invalidateLayerCache();
+            break;
+        case 'w': // Toggle window lights switching on and off
+            gWindowSwitching = !gWindowSwitching;
+            break;
+        case 'o': // Toggle sort-key ordered submission
+            gSort.enabled = !gSort.enabled;
+            break;
+        case 's': // Print renderer statistics for the last frame, on
+                  // stderr as stdout may carry a --capture - stream
+            fprintf(stderr, "draw calls %d (%d merged) | state calls %d, %d elided | "
+                    "ring: %d allocations, %lu KiB, %d stalls, %d wraps%s\n",
+                    gBatch.drawCalls, gSort.merged,
+                    gState.issued, gState.elided, gRing.allocations,
+                    (unsigned long)(gRing.bytes >> 10), gRing.stalls,
+                    gRing.wraps, gRing.persistent ? "" : " (mapped per draw)");
+            fprintf(stderr, "repainted %.1f%% of the screen in %d passes "
+                    "(%.1f%% average)\n",
+                    gDirty.repainted * 100.0f, (int)gDirty.paint.size(),
+                    gDirty.frames ? gDirty.repaintSum * 100.0 / gDirty.frames
+                                  : 100.0);
+            fprintf(stderr, "graph: %d of %d passes updated, %d drawn, %d culled | "
+                    "%d transient targets (%lu KiB) for %d requests\n",
+                    gGraph.updated, PASS_COUNT, gGraph.run, gGraph.culled,
+                    (int)gTransients.size(),
+                    (unsigned long)(transientBytes() >> 10),
+                    gTransientRequests);
+            fprintf(stderr, "impostors: %d buildings in the atlas, %d window updates "
+                    "(%d texels)\n", gImpostors.buildings,
+                    gImpostors.uploads, gImpostors.texels);
+            break;
     }
 }
 
+// Window resize: fit a 4:3 viewport and derive the render size from
+// it; cached layers are re-rendered at that size on their next use
+void reshape(int w, int h) {
+    gWindowW = std::max(1, w);
+    gWindowH = std::max(1, h);
+    gViewW = std::min(gWindowW, (int)(gWindowH * V_WIDTH / V_HEIGHT + 0.5f));
+    gViewH = std::min(gWindowH, (int)(gWindowW * V_HEIGHT / V_WIDTH + 0.5f));
+    gViewX = (gWindowW - gViewW) / 2;
+    gViewY = (gWindowH - gViewH) / 2;
+    gRenderW = std::max(1, (int)(gViewW * gRenderScale + 0.5f));
+    gRenderH = std::max(1, (int)(gViewH * gRenderScale + 0.5f));
+    setSceneViewport();
+    invalidateLayerCache();
+    resetTransients();
+}
+
 // Initialize OpenGL settings
 void init() {
     srand((unsigned int)time(NULL));
-    glShadeModel(GL_SMOOTH);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    gGraph.seed = (unsigned)rand();
+    if (!gHeadless) loadGLExtensions();
+    if (gCoreProfile && !(gHasGL33 && initShaderPipeline())) {
+        fprintf(stderr, "--core needs OpenGL 3.3 with GLSL 3.30\n");
+        exit(1);
+    }
+    initUnitCircles();
+    initGlowSprites();
+    initStreamRing();
+    if (gRing.vbo) initQuadIndices();
+    initMeshes();
+    initProps();
+    initAnimMeshes();
+    if (initBloom()) setLightHalos(false);
+    if (gHeadless) return;   // no GL state to set up
+    stateBlend(true);
+    stateBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+                   GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glEnable(GL_LINE_SMOOTH);
     glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluOrtho2D(0.0, V_WIDTH, 0.0, V_HEIGHT);
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    if (!gCoreProfile) {
+        // Fixed-function projection; the shader path uses a uniform
+        glShadeModel(GL_SMOOTH);
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        gluOrtho2D(0.0, V_WIDTH, 0.0, V_HEIGHT);
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+    }
     glClearColor(0.0f, 0.0f, 0.02f, 1.0f);
 }
 
+// --headless: render frames back to back with the software renderer and
+// report the rate; there is no window, so the animation steps once per
+// frame instead of on a timer
+void runHeadless(int frames, int threads) {
+    softSetThreads(threads);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int i = 0; i < frames; i++) {
+        display();
+        advanceAnimation();
+    }
+    double secs = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "headless: %d frames at %dx%d on %d threads (%s spans) in %.2f s, "
+            "%.1f fps (%.2f ms/frame, %d draws, %d tile commands)\n",
+            frames, gSoft.w, gSoft.h, threads, gSpan->name, secs,
+            frames / std::max(secs, 1e-9), secs * 1000.0 / frames,
+            gBatch.drawCalls, gSoft.binned);
+    softSetThreads(1);
+}
+
+// --bench-threads: render the same frame `frames` times on 1..N threads
+// and report the speed-up over one thread
+void benchThreads(int frames, int maxThreads) {
+    double base = 0.0;
+    display();   // size the frame
+    fprintf(stderr, "threads      fps  ms/frame  speed-up  (%dx%d, %d frames)\n",
+            gSoft.w, gSoft.h, frames);
+    for(int n = 1; n <= maxThreads; n++) {
+        softSetThreads(n);
+        display();   // warm up: size the frame and tile lists
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(int i = 0; i < frames; i++) display();
+        double secs = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        double fps = frames / std::max(secs, 1e-9);
+        if (n == 1) base = fps;
+        fprintf(stderr, "%7d %8.1f %9.2f %8.2fx\n",
+                n, fps, secs * 1000.0 / frames, fps / base);
+    }
+    softSetThreads(1);
+}
+
 // Main program entry point
 int main(int argc, char** argv) {
+    const char* capturePath = NULL;
+    int frames = 300;
+    int threads = std::max(1, (int)std::thread::hardware_concurrency());
+    bool bench = false, benchSpan = false;
+    const char* spanKernels = NULL;
+    for(int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--core") == 0) gCoreProfile = true;
+        else if (strcmp(argv[i], "--headless") == 0) gHeadless = true;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            frames = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threads = std::max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--bench-threads") == 0)
+            gHeadless = bench = true;
+        else if (strcmp(argv[i], "--bench-spans") == 0)
+            benchSpan = true;
+        else if (strcmp(argv[i], "--span-kernels") == 0 && i + 1 < argc)
+            spanKernels = argv[++i];
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+            sscanf(argv[++i], "%dx%d", &gWindowW, &gWindowH);
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+            capturePath = argv[++i];
+        else if (strcmp(argv[i], "--supersample") == 0 && i + 1 < argc)
+            gRenderScale = (float)std::max(1, std::min(4, atoi(argv[++i])));
+        else if (strcmp(argv[i], "--render-scale") == 0 && i + 1 < argc)
+            gRenderScale = std::max(0.25f, std::min(1.0f, (float)atof(argv[++i])));
+        else if (strcmp(argv[i], "--window-switching") == 0)
+            gWindowSwitching = true;
+    }
+    selectSpanKernels(spanKernels);
+    if (benchSpan) {
+        benchSpans();
+        return 0;
+    }
+    if (gHeadless) {
+        // No window and no GL: the scene goes through softDraw
+        gCoreProfile = false;
+        init();
+        reshape(gWindowW, gWindowH);
+        if (bench) {
+            benchThreads(frames, threads);
+            return 0;
+        }
+        if (capturePath && !beginCapture(capturePath)) return 1;
+        runHeadless(frames, threads);
+        endCapture();
+        return 0;
+    }
     glutInit(&argc, argv);
+    if (gCoreProfile) {
+        // Shader-only path: everything goes through the batch program
+        glutInitContextVersion(3, 3);
+        glutInitContextProfile(GLUT_CORE_PROFILE);
+    }
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGBA | GLUT_MULTISAMPLE);
-    glutInitWindowSize((int)V_WIDTH, (int)V_HEIGHT);
+    glutInitWindowSize(gWindowW, gWindowH);
     glutCreateWindow("Sunset Cityscape");
     init();
+    if (capturePath && !beginCapture(capturePath)) return 1;
     glutDisplayFunc(display);
+    glutCloseFunc(endCapture);
+    glutReshapeFunc(reshape);
     glutTimerFunc(0, update, 0);
     glutKeyboardFunc(keyboard);
     glutMainLoop();